@@ -0,0 +1,1411 @@
+// Best Fit memory partition allocator
+// The allocation logic of the simulator as a header-only library: partition tables and
+// waiting queues per pool, backfilling, routing between pools, placement across memory
+// tiers and per-operation latency.
+// Nothing here does I/O; results are returned as values and every decision is passed to
+// the registered observers, so the caller decides what to print, trace or wake up.
+#ifndef BESTFIT_ALLOCATOR_HPP
+#define BESTFIT_ALLOCATOR_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Struct to represent a memory partition (a block of memory). Only the fields read on every
+// scan live here (8 bytes, so a million partitions fit in 8 MB of cache); the rest is derived
+// or kept in PartitionInfo. The partition ID is its index + 1.
+struct Partition {
+    int size;      // Total size of the partition (e.g., in KB or units)
+    int jobNumber; // The job ID assigned to this partition (-1 if free)
+
+    bool isFree() const { return jobNumber == -1; }
+};
+
+// Cold per-partition data, only touched when a job is placed, freed or reserved
+struct PartitionInfo {
+    int jobSize;         // The size of the job allocated here (0 if free)
+    int reservedFor;     // Job number holding a backfill reservation on this partition (-1 if none)
+    uint32_t generation; // Bumped every time the partition is freed, so handles to earlier jobs stop matching
+    uint8_t tier;        // Memory tier the partition lives in (0 = fastest, see PlacementMode)
+};
+
+// Struct to represent a job (a process requesting memory)
+struct Job {
+    int jobNumber;         // Unique ID for the job (auto-incremented)
+    int jobSize;           // Memory size required by the job
+    int priority;          // Scheduling priority (higher is served first, 0 = normal)
+    long long enqueueTick; // Clock tick at which the job entered the waiting queue
+};
+
+// Number of clock ticks a waiting job must wait to gain one priority level (aging),
+// so low-priority jobs are eventually served instead of starving
+const int AGING_INTERVAL = 4;
+
+// Backfilling modes for the waiting queue:
+// - BACKFILL_NONE: every waiting job is tried in priority order, nothing is reserved
+// - BACKFILL_EASY: the first blocked job reserves the partition it will get next; other jobs
+//   backfill only into partitions that are not reserved
+// - BACKFILL_CONSERVATIVE: every blocked job reserves a partition of its own
+enum BackfillMode { BACKFILL_NONE, BACKFILL_EASY, BACKFILL_CONSERVATIVE };
+
+// Memory tiers: partitions are tagged with a tier, 0 for the fastest memory and higher
+// numbers for slower memory (e.g. 0 = local DRAM, 1 = remote NUMA node, 2 = CXL).
+// - PLACE_BEST_FIT: tiers are ignored; the smallest fitting partition wins
+// - PLACE_TIERED: best fit within the fastest tier that has room, then the next tier, ...
+// - PLACE_TIERED_PROMOTE: as PLACE_TIERED, and a freed partition that no waiting job takes
+//   is handed to the best-fitting job running in a slower tier, which moves up
+enum PlacementMode { PLACE_BEST_FIT, PLACE_TIERED, PLACE_TIERED_PROMOTE };
+const int MAX_TIERS = 8;
+
+// A blocked job together with the partition reserved for it
+struct Reservation {
+    Job job;            // The blocked job (held here instead of in the waiting queue heap)
+    int partitionIndex; // Index of the reserved partition in memory
+};
+
+// Aging key of a waiting job. Its effective priority is priority + waited / AGING_INTERVAL;
+// multiplying by AGING_INTERVAL gives priority * AGING_INTERVAL - enqueueTick + now, and since
+// "now" is the same for every waiting job the relative order never changes while jobs wait.
+// That lets a plain heap keep the aged order without re-keying anything on each tick.
+inline long long agingKey(const Job &j) {
+    return (long long)j.priority * AGING_INTERVAL - j.enqueueTick;
+}
+
+// Heap comparator: true if job a should be served after job b
+// (lower aged priority first; ties go to the job that was submitted later, keeping FIFO order)
+inline bool waitsBehind(const Job &a, const Job &b) {
+    if (agingKey(a) != agingKey(b)) return agingKey(a) < agingKey(b);
+    return a.jobNumber > b.jobNumber;
+}
+
+// Log-linear latency histogram in the style of HdrHistogram. Values below 64 ns get one
+// bucket each; above that every power-of-two range is split into 32 linear sub-buckets,
+// so any recorded value is known to within ~3% from nanoseconds up to hours.
+// Recording is a shift, an add and a few compares, cheap enough to leave always on.
+struct LatencyHistogram {
+    static const int SUB_BUCKET_BITS = 6;                   // 64 linear buckets below 64 ns
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int HALF = SUB_BUCKETS / 2;                // Sub-buckets per power of two above that
+    static const int BUCKETS = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * HALF;
+
+    uint64_t counts[BUCKETS] = {};
+    uint64_t total = 0;    // Number of recorded values
+    uint64_t sum = 0;      // Sum of recorded values (ns)
+    uint64_t maxValue = 0; // Largest recorded value (ns)
+
+    // Bucket holding a value
+    static int bucketOf(uint64_t v) {
+        if (v < SUB_BUCKETS) return (int)v;
+        int shift = (63 - __builtin_clzll(v)) - (SUB_BUCKET_BITS - 1); // Keeps v >> shift in [32, 64)
+        return SUB_BUCKETS + (shift - 1) * HALF + (int)((v >> shift) - HALF);
+    }
+
+    // Smallest and largest value that fall into a bucket
+    static uint64_t bucketLow(int b) {
+        if (b < SUB_BUCKETS) return b;
+        int shift = (b - SUB_BUCKETS) / HALF + 1;
+        return (uint64_t)((b - SUB_BUCKETS) % HALF + HALF) << shift;
+    }
+    static uint64_t bucketHigh(int b) {
+        if (b < SUB_BUCKETS) return b;
+        int shift = (b - SUB_BUCKETS) / HALF + 1;
+        return bucketLow(b) + ((uint64_t)1 << shift) - 1;
+    }
+
+    void record(uint64_t ns) {
+        counts[bucketOf(ns)]++;
+        total++;
+        sum += ns;
+        if (ns > maxValue) maxValue = ns;
+    }
+
+    // Value at or below which the given fraction (0..1) of recordings fall
+    // (reported as the top of the bucket, never above the recorded maximum)
+    uint64_t percentile(double fraction) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(fraction * total + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            seen += counts[b];
+            if (seen >= rank) return std::min(bucketHigh(b), maxValue);
+        }
+        return maxValue;
+    }
+
+    // Add another histogram's recordings to this one
+    void merge(const LatencyHistogram &other) {
+        for (int b = 0; b < BUCKETS; b++) counts[b] += other.counts[b];
+        total += other.total;
+        sum += other.sum;
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    // Number of recordings whose whole bucket lies at or below a bound
+    // (a bucket straddling the bound counts as above it)
+    uint64_t countAtOrBelow(uint64_t ns) const {
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS && bucketHigh(b) <= ns; b++) seen += counts[b];
+        return seen;
+    }
+};
+
+// Measures the time from construction until stop() and records it into a histogram
+struct LatencyTimer {
+    LatencyHistogram &histogram;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    explicit LatencyTimer(LatencyHistogram &h) : histogram(h) {}
+
+    void stop() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+// Bit set over 0..n-1 that finds the first set bit at or after a position in O(log64 n):
+// level 0 holds the bits, and each level above has one bit per non-empty word of the one below.
+struct SetBits {
+    std::vector<std::vector<uint64_t>> words;
+
+    void assign(int n) {
+        words.clear();
+        do {
+            n = (n + 63) / 64;
+            words.emplace_back(n, 0);
+        } while (n > 1);
+    }
+
+    void set(int i) {
+        for (std::vector<uint64_t> &level : words) {
+            uint64_t &word = level[i >> 6];
+            bool wasEmpty = word == 0;
+            word |= uint64_t(1) << (i & 63);
+            if (!wasEmpty) return;
+            i >>= 6;
+        }
+    }
+
+    void reset(int i) {
+        for (std::vector<uint64_t> &level : words) {
+            uint64_t &word = level[i >> 6];
+            word &= ~(uint64_t(1) << (i & 63));
+            if (word != 0) return;
+            i >>= 6;
+        }
+    }
+
+    // First set bit at or after i, or -1
+    int next(int i) const {
+        size_t k = 0;
+        // Climb until some word holds a set bit at or after i
+        while (true) {
+            if (k == words.size() || (size_t)(i >> 6) >= words[k].size()) return -1;
+            uint64_t word = words[k][i >> 6] & (~uint64_t(0) << (i & 63));
+            if (word != 0) {
+                i = (i & ~63) | __builtin_ctzll(word);
+                break;
+            }
+            i = (i >> 6) + 1;
+            k++;
+        }
+        // Then take the first set bit of the word it stands for, down to level 0
+        while (k > 0) {
+            k--;
+            i = (i << 6) | __builtin_ctzll(words[k][i]);
+        }
+        return i;
+    }
+};
+
+// Best-fit index of a pool: a segment tree over the partition slots sorted by (size, index),
+// or by (tier, size, index) for tiered placement, where each tier is searched in turn.
+// Each node keeps the smallest partition index that is available (free and not reserved)
+// below it. The smallest available partition of at least k is then the leftmost available
+// slot at or after the first slot of size >= k, found in O(log n).
+// A search restricted to partitions first..last uses a second structure, built on the first
+// such search: a merge-sort tree over partition index, where each aligned run of 2^j indices
+// keeps its partitions' slots sorted, with a bit set marking the available ones. first..last
+// splits into O(log n) runs; in each, a lower_bound finds the first slot of size >= k and the
+// bit set the first available slot after it, so a range query is O(log^2 n) however many
+// partitions are free outside the range. It holds about n log n ints, and ranges of fewer
+// than RANGE_SCAN partitions skip it and are scanned directly.
+// Allocation changes update one leaf and its ancestors in O(log n), plus one entry per level
+// of the range structure in O(log^2 n) once it is built. Partitions are only ever added at
+// setup, so adding one just marks the index stale and it is rebuilt on next use.
+// In front of the tree sits a free list per partition size (and tier, when tiered): a job
+// whose size matches a partition size exactly is served from it without touching the tree.
+// Each list is a min-heap of partition indices, so equal exact fits go to the lowest index,
+// as everywhere else. Reading the top is O(1); a partition that becomes unavailable keeps
+// its entry until it reaches the top and is dropped there, so each placement costs one
+// O(log m) heap pop (m = partitions of that size) spread over the following lookups.
+struct BestFitIndex {
+    std::vector<int> order;       // Partition indices sorted by size (tier first if tiered), then index
+    std::vector<int> slotOf;      // Slot of each partition index in order
+    std::vector<int> sortedSizes; // Size of the partition in each slot (for lower_bound)
+    std::vector<int> minIndex;    // Per tree node: smallest available partition index (INT_MAX if none)
+    int leaves = 1;               // Leaf count, a power of two >= number of partitions
+    std::vector<int> groupStart;  // First slot of each tier searched, then the slot count (one group if not tiered)
+    std::vector<int> groupTier;   // Tier of each group (0 if not tiered)
+    std::unordered_map<long long, std::vector<int>> freeBySize; // Partition indices per listKey (a min-heap, may hold unavailable ones)
+    std::vector<char> listed;     // Whether a partition has an entry in its size's free list
+    std::vector<std::vector<int>> runSlots; // Per level j: slots of each aligned run of 2^j partition indices, sorted
+    std::vector<SetBits> runAvailable;      // Per level j: which entries of runSlots[j] are available
+    bool rangeBuilt = false;      // runSlots is built and kept up to date
+    bool byTier = false;          // Sorted and searched tier by tier
+    bool stale = true;            // Partitions were added (or the placement mode changed) since the last rebuild
+
+    static const int RANGE_SCAN = 64; // Ranges narrower than this are scanned, not looked up
+
+    static bool available(const std::vector<Partition> &memory, const std::vector<PartitionInfo> &info, int i) {
+        return memory[i].isFree() && info[i].reservedFor == -1;
+    }
+
+    // Free-list key: the exact size, within the partition's tier when tiered
+    long long listKey(const std::vector<PartitionInfo> &info, int size, int index) const {
+        return ((long long)(byTier ? info[index].tier : 0) << 32) | size;
+    }
+
+    void rebuild(const std::vector<Partition> &memory, const std::vector<PartitionInfo> &info) {
+        int n = (int)memory.size();
+        order.resize(n);
+        for (int i = 0; i < n; i++) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            if (byTier && info[a].tier != info[b].tier) return info[a].tier < info[b].tier;
+            return memory[a].size < memory[b].size;
+        });
+        slotOf.assign(n, 0);
+        sortedSizes.resize(n);
+        groupStart.assign(1, 0);
+        groupTier.assign(1, byTier && n > 0 ? info[order[0]].tier : 0);
+        for (int s = 0; s < n; s++) {
+            slotOf[order[s]] = s;
+            sortedSizes[s] = memory[order[s]].size;
+            if (byTier && s > 0 && info[order[s]].tier != info[order[s - 1]].tier) {
+                groupStart.push_back(s);
+                groupTier.push_back(info[order[s]].tier);
+            }
+        }
+        groupStart.push_back(n);
+
+        leaves = 1;
+        while (leaves < n) leaves *= 2;
+        minIndex.assign(2 * leaves, INT_MAX);
+        for (int s = 0; s < n; s++)
+            if (available(memory, info, order[s])) minIndex[leaves + s] = order[s];
+        for (int node = leaves - 1; node >= 1; node--) pull(node);
+
+        // Appended in increasing index order, which is already a valid min-heap
+        freeBySize.clear();
+        listed.assign(n, 0);
+        for (int i = 0; i < n; i++) {
+            if (!available(memory, info, i)) continue;
+            freeBySize[listKey(info, memory[i].size, i)].push_back(i);
+            listed[i] = 1;
+        }
+        runSlots.clear();
+        runAvailable.clear();
+        rangeBuilt = false;
+        stale = false;
+    }
+
+    // Build runSlots level by level, each run merged from its two halves one level down
+    void buildRanges(const std::vector<Partition> &memory, const std::vector<PartitionInfo> &info) {
+        int n = (int)order.size();
+        runSlots.assign(1, slotOf);
+        for (long long width = 1; width < n; width *= 2) {
+            std::vector<int> level(n);
+            const std::vector<int> &below = runSlots.back();
+            for (long long lo = 0; lo < n; lo += 2 * width) {
+                long long mid = std::min(lo + width, (long long)n), hi = std::min(lo + 2 * width, (long long)n);
+                std::merge(below.begin() + lo, below.begin() + mid, below.begin() + mid, below.begin() + hi,
+                           level.begin() + lo);
+            }
+            runSlots.push_back(std::move(level));
+        }
+        runAvailable.assign(runSlots.size(), SetBits());
+        for (size_t j = 0; j < runSlots.size(); j++) {
+            runAvailable[j].assign(n);
+            for (int p = 0; p < n; p++)
+                if (available(memory, info, order[runSlots[j][p]])) runAvailable[j].set(p);
+        }
+        rangeBuilt = true;
+    }
+
+    void listAdd(long long key, int index) {
+        std::vector<int> &list = freeBySize[key];
+        list.push_back(index);
+        std::push_heap(list.begin(), list.end(), std::greater<int>());
+        listed[index] = 1;
+    }
+
+    void pull(int node) {
+        minIndex[node] = std::min(minIndex[2 * node], minIndex[2 * node + 1]);
+    }
+
+    // Refresh one partition after its free or reserved state changed
+    void update(const std::vector<Partition> &memory, const std::vector<PartitionInfo> &info, int index) {
+        if (stale) return; // Rebuilt from the partitions on next use anyway
+        int node = leaves + slotOf[index];
+        bool on = available(memory, info, index);
+        minIndex[node] = on ? index : INT_MAX;
+        for (node /= 2; node >= 1; node /= 2) pull(node);
+
+        if (rangeBuilt) {
+            int n = (int)order.size();
+            for (size_t j = 0; j < runSlots.size(); j++) {
+                long long lo = (long long)index >> j << j, hi = std::min(lo + (1LL << j), (long long)n);
+                const std::vector<int> &slots = runSlots[j];
+                int p = (int)(std::lower_bound(slots.begin() + lo, slots.begin() + hi, slotOf[index]) - slots.begin());
+                if (on) runAvailable[j].set(p);
+                else runAvailable[j].reset(p);
+            }
+        }
+
+        if (on && !listed[index]) listAdd(listKey(info, memory[index].size, index), index);
+        // An unavailable partition stays listed until exactFit finds it on top
+    }
+
+    // Size of the largest available partition, or 0 if none: the rightmost available slot
+    // of each tier searched
+    int maxAvailableSize() const {
+        int largest = 0;
+        for (size_t g = 0; g + 1 < groupStart.size(); g++) {
+            int slot = rightmost(1, 0, leaves - 1, groupStart[g], groupStart[g + 1] - 1);
+            if (slot != -1) largest = std::max(largest, sortedSizes[slot]);
+        }
+        return largest;
+    }
+
+    // Lowest-index available partition whose free-list key is exactly key, or -1. One hash
+    // lookup, plus a heap pop for each entry on top whose partition is no longer available.
+    int exactFit(const std::vector<Partition> &memory, const std::vector<PartitionInfo> &info, long long key) {
+        auto it = freeBySize.find(key);
+        if (it == freeBySize.end()) return -1;
+        std::vector<int> &list = it->second;
+        while (!list.empty() && !available(memory, info, list.front())) {
+            listed[list.front()] = 0;
+            std::pop_heap(list.begin(), list.end(), std::greater<int>());
+            list.pop_back();
+        }
+        return list.empty() ? -1 : list.front();
+    }
+
+    // Smallest available partition of at least minSize among partitions first..last
+    // (lowest index on ties), or -1. Tiered, the fastest tier with such a partition wins.
+    // O(log n) over the whole pool, O(log^2 n) over a narrower range.
+    int query(const std::vector<Partition> &memory, const std::vector<PartitionInfo> &info,
+              int minSize, int first, int last) {
+        int n = (int)order.size();
+        bool whole = first <= 0 && last >= n - 1; // The free lists and the slot tree are not range-aware
+        if (!whole) {
+            first = std::max(first, 0);
+            last = std::min(last, n - 1);
+            if (first > last) return -1;
+            if (last - first < RANGE_SCAN) {
+                // Lowest slot wins: fastest tier, then smallest size, then lowest index
+                int best = -1;
+                for (int i = first; i <= last; i++)
+                    if (memory[i].size >= minSize && available(memory, info, i) &&
+                        (best == -1 || slotOf[i] < slotOf[best]))
+                        best = i;
+                return best;
+            }
+            if (!rangeBuilt) buildRanges(memory, info);
+        }
+        for (size_t g = 0; g + 1 < groupStart.size(); g++) {
+            int begin = groupStart[g], end = groupStart[g + 1];
+            if (whole) {
+                int exact = exactFit(memory, info, ((long long)groupTier[g] << 32) | minSize);
+                if (exact != -1) return exact;
+            }
+            int from = (int)(std::lower_bound(sortedSizes.begin() + begin, sortedSizes.begin() + end, minSize) -
+                             sortedSizes.begin());
+            if (from == end) continue;
+            int found = whole ? leftmost(1, 0, leaves - 1, from, end - 1) : rangeLeftmost(from, end, first, last);
+            if (found != -1) return found;
+        }
+        return -1;
+    }
+
+    // Leftmost slot in the subtree at node (covering slots lo..hi) within slots from..to
+    // whose partition is available; returns the partition index or -1
+    int leftmost(int node, int lo, int hi, int from, int to) const {
+        if (hi < from || lo > to || minIndex[node] == INT_MAX) return -1;
+        if (lo == hi) return order[lo];
+        int mid = (lo + hi) / 2;
+        int found = leftmost(2 * node, lo, mid, from, to);
+        return found != -1 ? found : leftmost(2 * node + 1, mid + 1, hi, from, to);
+    }
+
+    // Partition in the lowest available slot within slots from..end-1 among partitions
+    // first..last, or -1. first..last is cut into the largest aligned runs that fit; each run
+    // contributes the first available slot at or after from.
+    int rangeLeftmost(int from, int end, int first, int last) const {
+        int best = INT_MAX;
+        for (long long lo = first; lo <= last;) {
+            size_t j = 0;
+            while (j + 1 < runSlots.size() && (lo & ((2LL << j) - 1)) == 0 && lo + (2LL << j) - 1 <= last) j++;
+            long long hi = lo + (1LL << j);
+            const std::vector<int> &slots = runSlots[j];
+            int p = (int)(std::lower_bound(slots.begin() + lo, slots.begin() + hi, from) - slots.begin());
+            int q = runAvailable[j].next(p);
+            if (q != -1 && q < hi && slots[q] < end) best = std::min(best, slots[q]);
+            lo = hi;
+        }
+        return best == INT_MAX ? -1 : order[best];
+    }
+
+    // Rightmost slot within slots from..to whose partition is available, or -1
+    int rightmost(int node, int lo, int hi, int from, int to) const {
+        if (hi < from || lo > to || minIndex[node] == INT_MAX) return -1;
+        if (lo == hi) return lo;
+        int mid = (lo + hi) / 2;
+        int found = rightmost(2 * node + 1, mid + 1, hi, from, to);
+        return found != -1 ? found : rightmost(2 * node, lo, mid, from, to);
+    }
+};
+
+// Running totals of one memory tier of a pool
+struct TierUsage {
+    int partitions = 0;      // Partitions in the tier
+    int used = 0;            // Of which in use
+    long long capacity = 0;  // Sum of their sizes
+    long long jobMemory = 0; // Memory requested by the jobs placed in the tier
+};
+
+// A memory pool (one memory region of the machine) with its own partitions, waiting queue
+// and statistics. Jobs are numbered globally; each job lives in exactly one pool.
+// - memory: List of the pool's partitions (hot fields; info holds the cold ones, same index)
+// - waitingQueue: Jobs waiting for a partition of this pool,
+//   kept as a binary heap ordered by aged priority (see waitsBehind)
+// - deallocatedJobs: Jobs that have been deallocated (for historical tracking)
+struct MemoryPool {
+    std::string name;
+    std::vector<Partition> memory;
+    std::vector<PartitionInfo> info;
+    std::vector<Job> waitingQueue;
+    std::vector<Job> deallocatedJobs;
+    std::vector<Reservation> reservations; // Blocked jobs holding a partition reservation (backfilling)
+    int freePartitions = 0;                // Number of free partitions, maintained on every allocation change
+    int largestPartition = 0;              // Size of the largest partition (jobs above it are rejected)
+    int smallestWaiting = INT_MAX;         // Lower bound on the size of every job in the waiting queue heap
+    BestFitIndex fitIndex;                 // Finds the best free partition without scanning the table
+    bool retryPending = false;             // A deallocation's waiting-queue pass is deferred (coalescing)
+    bool tiered = false;                   // Placement prefers faster tiers (set from the allocator's PlacementMode)
+    std::vector<int> promotionCandidates;  // Freed partitions to offer to jobs in slower tiers (PLACE_TIERED_PROMOTE)
+
+    // Scheduling metrics used to compare backfilling modes
+    long long jobsPlaced = 0;   // Jobs assigned to a partition (directly or from the waiting queue)
+    long long maxWaitTicks = 0; // Longest wait (in ticks) of any job placed from the waiting queue
+
+    // Running totals kept up to date on every allocation change, so metrics can be
+    // exported without walking the partition table
+    long long jobsQueued = 0;              // Jobs that found no partition and were added to the waiting queue
+    long long jobsRejected = 0;            // Jobs larger than every partition, turned away at once
+    long long jobsQueueFull = 0;           // Jobs turned away because the waiting queue was full
+    long long jobsDropped = 0;             // Waiting jobs dropped to make room for newer ones
+    long long jobsSpilled = 0;             // Jobs that overflowed into the spill store
+    long long spilledJobs = 0;             // Jobs currently in the spill store
+    long long jobsDeallocated = 0;         // Successful deallocations
+    long long jobsPromoted = 0;            // Running jobs moved to a faster tier
+    std::vector<TierUsage> tierUsage;      // Per tier, indexed by tier (as many as the slowest tier needs)
+    long long totalInternalFragment = 0;   // Sum of internal fragmentation over used partitions
+    double utilizationSum = 0.0;           // Sum of (jobSize / size) * 100 over used partitions
+
+    // Wasted space in a partition (size - jobSize; 0 if free)
+    int internalFragment(int index) const {
+        return memory[index].isFree() ? 0 : memory[index].size - info[index].jobSize;
+    }
+
+    // Best-fit order of a partition: its size, behind every faster tier when tiered
+    long long fitRank(int index) const {
+        return ((long long)(tiered ? info[index].tier : 0) << 32) | memory[index].size;
+    }
+};
+
+// Waiting jobs of a pool (including those holding a reservation) in service order
+inline std::vector<Job> waitingInServiceOrder(const MemoryPool &pool) {
+    std::vector<Job> ordered = pool.waitingQueue;
+    for (auto &r : pool.reservations) ordered.push_back(r.job);
+    std::sort(ordered.begin(), ordered.end(), [](const Job &a, const Job &b) { return waitsBehind(b, a); });
+    return ordered;
+}
+
+// Partition index reserved for a waiting job, or -1
+inline int reservedPartitionOf(const MemoryPool &pool, int jobNumber) {
+    for (auto &r : pool.reservations)
+        if (r.job.jobNumber == jobNumber) return r.partitionIndex;
+    return -1;
+}
+
+// Share of a pool's partitions currently in use (0 for an empty pool)
+inline double poolBusyFraction(const MemoryPool &pool) {
+    return pool.memory.empty() ? 0.0 : (double)(pool.memory.size() - pool.freePartitions) / pool.memory.size();
+}
+
+// Distribution of the leftover space (size - jobSize) over the used partitions of a pool.
+// The histogram is the latency one: exact below 64, within ~3% above, exact maximum.
+struct LeftoverStats {
+    long long used = 0;         // Used partitions
+    int minLeftover = INT_MAX;  // Smallest leftover (INT_MAX if nothing is used)
+    LatencyHistogram histogram; // Leftovers, for the maximum and the percentiles
+
+    void merge(const LeftoverStats &other) {
+        used += other.used;
+        minLeftover = std::min(minLeftover, other.minLeftover);
+        histogram.merge(other.histogram);
+    }
+};
+
+// Partitions per thread in a chunked scan; smaller pools are scanned on the calling thread
+const int SCAN_CHUNK = 1 << 18;
+
+// Number of chunks forEachChunk splits n partitions into: one per core, each of at least
+// SCAN_CHUNK partitions, and always at least one
+inline int chunkCount(int n) {
+    int cores = (int)std::max(1u, std::thread::hardware_concurrency());
+    return std::max(1, std::min(cores, (n + SCAN_CHUNK - 1) / SCAN_CHUNK));
+}
+
+// Call fn(chunk, first, last) for each of the chunkCount(n) contiguous chunks first..last-1
+// of 0..n-1, numbered in index order. Chunk 0 runs on the calling thread, the others on
+// threads of their own; returns once all are done.
+template <class Fn>
+void forEachChunk(int n, Fn fn) {
+    int threads = chunkCount(n);
+    if (threads == 1) {
+        fn(0, 0, n);
+        return;
+    }
+    int chunk = (n + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) workers.emplace_back(fn, t, t * chunk, std::min(n, (t + 1) * chunk));
+    fn(0, 0, chunk);
+    for (auto &w : workers) w.join();
+}
+
+// Walk a pool's partitions and collect the leftover distribution. Unlike the running totals
+// this needs every partition, so large pools are scanned in chunks, each reduced into its
+// own LeftoverStats and merged at the end (the merge is order-independent).
+inline LeftoverStats leftoverStats(const MemoryPool &pool) {
+    auto scan = [&pool](LeftoverStats &stats, int first, int last) {
+        for (int i = first; i < last; i++) {
+            if (pool.memory[i].isFree()) continue;
+            int leftover = pool.internalFragment(i);
+            stats.used++;
+            stats.minLeftover = std::min(stats.minLeftover, leftover);
+            stats.histogram.record(leftover);
+        }
+    };
+
+    int n = (int)pool.memory.size();
+    std::vector<LeftoverStats> partial(chunkCount(n));
+    forEachChunk(n, [&](int t, int first, int last) { scan(partial[t], first, last); });
+    for (size_t t = 1; t < partial.size(); t++) partial[0].merge(partial[t]);
+    return partial[0];
+}
+
+// Best fit by a linear scan over partitions 0..n-1, for searches the BestFitIndex cannot
+// answer: among the partitions for which eligible(index) holds, the one with the smallest
+// rank(index) (e.g. its size), lowest index on ties, or -1.
+// Large pools are scanned in chunks and each chunk's best is found concurrently. The chunk results are reduced in chunk order and only a strictly smaller
+// rank replaces the current best, so ties still go to the lowest index.
+template <class Eligible, class Rank>
+int parallelBestFit(int n, Eligible eligible, Rank rank) {
+    auto scan = [&eligible, &rank](int &best, int first, int last) {
+        best = -1;
+        long long bestRank = 0;
+        for (int i = first; i < last; i++) {
+            if (!eligible(i)) continue;
+            long long r = rank(i);
+            if (best == -1 || r < bestRank) { best = i; bestRank = r; }
+        }
+    };
+
+    std::vector<int> partial(chunkCount(n), -1);
+    forEachChunk(n, [&](int t, int first, int last) { scan(partial[t], first, last); });
+    int best = -1;
+    for (int index : partial)
+        if (index != -1 && (best == -1 || rank(index) < rank(best))) best = index;
+    return best;
+}
+
+// Pool names end up in metric labels and file columns, so keep them to [A-Za-z0-9_-]
+inline bool validPoolName(const std::string &name) {
+    if (name.empty()) return false;
+    for (char c : name)
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-') return false;
+    return true;
+}
+
+// Where a job went: pool index and partition index in that pool (-1 if it is waiting or
+// unknown, INDEX_REJECTED if no partition of the pool could ever hold it, INDEX_QUEUE_FULL
+// if it had to wait but the pool's waiting queue was full).
+// The Placement of a placed job doubles as its handle: together with the partition's
+// generation at placement time it lets deallocateHandle free the job in O(1), and it stops
+// matching as soon as the job is freed, so stale and duplicate frees are detected. A job
+// promoted to a faster tier keeps its handle: the allocator forwards it to the new partition.
+struct Placement {
+    int pool;
+    int index;
+    uint32_t generation = 0;
+};
+
+inline bool operator==(const Placement &a, const Placement &b) {
+    return a.pool == b.pool && a.index == b.index && a.generation == b.generation;
+}
+
+// Hash of a handle, for maps keyed by handles
+struct PlacementHash {
+    size_t operator()(const Placement &h) const {
+        uint64_t key = ((uint64_t)(uint32_t)h.pool << 32 | (uint32_t)h.index) * 0x9E3779B97F4A7C15ULL;
+        return (size_t)(key ^ h.generation);
+    }
+};
+const int INDEX_REJECTED = -2;
+const int INDEX_QUEUE_FULL = -3;
+
+// What happens to a job that has to wait when its pool's waiting queue is at capacity:
+// - OVERFLOW_REJECT: the new job is turned away (INDEX_QUEUE_FULL)
+// - OVERFLOW_DROP_OLDEST: the job that has waited longest leaves the queue to make room
+// - OVERFLOW_SPILL: the new job goes to the spill store and comes back, oldest first, as the
+//   queue drains; spilled jobs keep their enqueue tick, so they lose no aging
+// Jobs holding a backfill reservation count towards the capacity but are never dropped.
+enum OverflowPolicy { OVERFLOW_REJECT, OVERFLOW_DROP_OLDEST, OVERFLOW_SPILL };
+
+// Where OVERFLOW_SPILL puts jobs (one FIFO per pool). The allocator does no I/O itself,
+// so the caller supplies the store, e.g. one backed by a file.
+struct SpillStore {
+    virtual ~SpillStore() = default;
+    virtual void push(int pool, const Job &job) = 0;
+    virtual Job pop(int pool) = 0; // Only called when the pool has spilled jobs
+};
+
+// How the router picks a pool for a job that does not ask for one:
+// - ROUTE_AFFINITY: always the first pool
+// - ROUTE_LEAST_UTILIZED: the pool with the smallest share of partitions in use that can place it
+// - ROUTE_BEST_FIT: the pool holding the best-fitting free partition across all pools
+// A job that names a pool (its affinity) always goes there, whatever the policy.
+enum RoutingPolicy { ROUTE_AFFINITY, ROUTE_LEAST_UTILIZED, ROUTE_BEST_FIT };
+
+// Allocator decisions passed to observers
+// - EVENT_ALLOCATE: a new job was placed
+// - EVENT_QUEUE: a new job found no partition and waits in its pool's queue
+// - EVENT_WAKEUP: a waiting job was placed after a deallocation
+// - EVENT_DEALLOCATE: a job left its partition
+// - EVENT_REJECT: a new job is larger than every partition of its pool
+// - EVENT_QUEUE_FULL: a new job had to wait but the waiting queue was full (OVERFLOW_REJECT)
+// - EVENT_DROP: a waiting job was dropped to make room for a new one (OVERFLOW_DROP_OLDEST)
+// - EVENT_SPILL: a new job had to wait and went to the spill store (OVERFLOW_SPILL)
+// - EVENT_PROMOTE: a running job moved to a faster tier (PLACE_TIERED_PROMOTE); the
+//   placement is its new partition. The handle the job was given still frees it, and so
+//   does this placement
+enum AllocatorEventType : uint8_t {
+    EVENT_ALLOCATE, EVENT_QUEUE, EVENT_WAKEUP, EVENT_DEALLOCATE, EVENT_REJECT,
+    EVENT_QUEUE_FULL, EVENT_DROP, EVENT_SPILL, EVENT_PROMOTE
+};
+
+// One decision: the job and where it went (index -1 / INDEX_REJECTED as in Placement; for
+// placements and deallocations the generation is the one the job's handle carries)
+struct AllocatorEvent {
+    AllocatorEventType type;
+    Placement placement;
+    int jobNumber;
+    int jobSize;
+};
+
+using AllocatorObserver = std::function<void(const AllocatorEvent &)>;
+
+// Best Fit allocator over one or more memory pools.
+// Observers are called synchronously after the operation's latency has been recorded, so
+// their cost never shows up in the histograms. They run in decision order (a deallocation
+// before the waiting jobs it lets in) and must not call back into the allocator.
+class BestFitAllocator {
+public:
+    // Create an empty pool and return its index
+    int addPool(const std::string &name) {
+        poolList.emplace_back();
+        poolList.back().name = name;
+        poolList.back().tiered = poolList.back().fitIndex.byTier = (placement != PLACE_BEST_FIT);
+        return (int)poolList.size() - 1;
+    }
+
+    // Index of the pool with a given name, or -1
+    int findPool(const std::string &name) const {
+        for (int p = 0; p < (int)poolList.size(); p++)
+            if (poolList[p].name == name) return p;
+        return -1;
+    }
+
+    // Append a free partition to a pool (IDs are numbered 1, 2, 3... within each pool)
+    // in the given memory tier (0 = fastest, below MAX_TIERS)
+    void addPartition(int poolIndex, int size, int tier = 0) {
+        MemoryPool &pool = poolList[poolIndex];
+        pool.memory.push_back({size, -1});
+        pool.info.push_back({0, -1, 0, (uint8_t)tier});
+        if ((int)pool.tierUsage.size() <= tier) pool.tierUsage.resize(tier + 1);
+        pool.tierUsage[tier].partitions++;
+        pool.tierUsage[tier].capacity += size;
+        pool.fitIndex.stale = true;
+        pool.freePartitions++;
+        pool.largestPartition = std::max(pool.largestPartition, size);
+    }
+
+    // Allocate a job using Best Fit
+    // The router picks the pool (affinity = pool index, or -1 to let the routing policy choose).
+    // A job larger than every partition of that pool could never be placed, so it is rejected
+    // instead of waiting forever.
+    // A job that has to wait while its pool's queue is full is handled by the overflow policy.
+    // For locality-aware placement only partitions first..last (indices, inclusive) of the
+    // pool are searched, in whichever pool is considered. The range only applies now: a job
+    // that has to wait is later placed from the waiting queue like any other, anywhere in its pool.
+    // Returns where the job went; the partition index is -1 if it was queued (or spilled),
+    // INDEX_REJECTED if rejected, INDEX_QUEUE_FULL if turned away by a full queue
+    Placement allocate(Job job, int affinity = -1, int first = 0, int last = INT_MAX) {
+        flushRetries(); // Deferred passes go first, so a new job never jumps the waiting queue
+        LatencyTimer timer(allocateHistogram);
+        schedulerTick++;
+        Placement placement = routeJob(job, affinity, first, last);
+        MemoryPool &pool = poolList[placement.pool];
+
+        if (placement.index == -1 && job.jobSize > pool.largestPartition) {
+            placement.index = INDEX_REJECTED;
+            pool.jobsRejected++;
+            timer.stop();
+            notify(EVENT_REJECT, placement, job);
+            return placement;
+        }
+
+        // A full queue makes room, spills the job or turns it away
+        if (placement.index == -1 && queueLimit > 0 && waitingJobs(pool) >= queueLimit) {
+            if (overflow == OVERFLOW_SPILL && spillStore != nullptr) {
+                job.enqueueTick = schedulerTick;
+                spillStore->push(placement.pool, job);
+                pool.spilledJobs++;
+                pool.jobsSpilled++;
+                pool.jobsQueued++;
+                timer.stop();
+                notify(EVENT_SPILL, placement, job);
+                return placement;
+            }
+            Job dropped = {};
+            if (overflow != OVERFLOW_DROP_OLDEST || !dropOldest(pool, dropped)) {
+                placement.index = INDEX_QUEUE_FULL;
+                pool.jobsQueueFull++;
+                timer.stop();
+                notify(EVENT_QUEUE_FULL, placement, job);
+                return placement;
+            }
+            pool.jobsDropped++;
+            pushWaiting(pool, job);
+            pool.jobsQueued++;
+            timer.stop();
+            notify(EVENT_DROP, placement, dropped);
+            notify(EVENT_QUEUE, placement, job);
+            return placement;
+        }
+
+        // If no suitable partition found, add job to waiting queue
+        if (placement.index == -1) {
+            pushWaiting(pool, job);
+            pool.jobsQueued++;
+            timer.stop();
+            notify(EVENT_QUEUE, placement, job);
+            return placement;
+        }
+
+        // Allocate the job to the best partition
+        placeJob(pool, placement.index, job);
+        placement.generation = pool.info[placement.index].generation;
+        timer.stop();
+        notify(EVENT_ALLOCATE, placement, job);
+        return placement;
+    }
+
+    // Deallocate a job from its partition (in whichever pool holds it)
+    // Returns where the job was freed from, or {-1, -1} if no partition holds the job
+    Placement deallocate(int jobNumber) {
+        LatencyTimer timer(deallocateHistogram);
+        schedulerTick++;
+
+        // Search for the partition with the matching job
+        for (int poolIndex = 0; poolIndex < (int)poolList.size(); poolIndex++) {
+            int index = findJob(poolList[poolIndex], jobNumber);
+            if (index == -1) continue;
+            uint32_t generation = poolList[poolIndex].info[index].generation;
+            releasePartition(poolIndex, index, timer);
+            return {poolIndex, index, generation}; // Exit after deallocating
+        }
+        timer.stop();
+        return {-1, -1};
+    }
+
+    // Deallocate the job a handle (the Placement returned when it was placed) refers to.
+    // Only that one partition is looked at, after one hash lookup if the job was promoted.
+    // Returns the job number freed (and where it was freed from in *freedFrom, if given), or
+    // -1 if the handle is stale (its job was already freed, possibly followed by another job)
+    // or invalid.
+    int deallocateHandle(Placement handle, Placement *freedFrom = nullptr) {
+        LatencyTimer timer(deallocateHistogram);
+        schedulerTick++;
+
+        if (!movedTo.empty()) {
+            auto moved = movedTo.find(handle);
+            if (moved != movedTo.end()) handle = moved->second;
+        }
+        if (handle.pool >= 0 && handle.pool < (int)poolList.size() &&
+            handle.index >= 0 && handle.index < (int)poolList[handle.pool].memory.size()) {
+            MemoryPool &pool = poolList[handle.pool];
+            if (!pool.memory[handle.index].isFree() && pool.info[handle.index].generation == handle.generation) {
+                int jobNumber = pool.memory[handle.index].jobNumber;
+                if (freedFrom != nullptr) *freedFrom = handle;
+                releasePartition(handle.pool, handle.index, timer);
+                return jobNumber;
+            }
+        }
+        timer.stop();
+        return -1;
+    }
+
+    // Deallocation coalescing. With a window, the waiting-queue pass a deallocation triggers
+    // is deferred until `count` deallocations are pending or the first of them is `delayNs`
+    // old (0 = no time limit). Both are checked as deallocations arrive; the age is also
+    // checked by flushRetriesIfExpired(), which callers that can go idle call when they wake
+    // up. The next allocate or flushRetries() closes the window early. Closing it runs one
+    // pass per affected pool, in pool order, as if every deallocation of the batch had
+    // happened at once.
+    // A count of 1 (the default) retries after every deallocation.
+    void setCoalescing(int count, long long delayNs) {
+        flushRetries();
+        coalesceCount = std::max(count, 1);
+        coalesceDelayNs = std::max(delayNs, 0LL);
+    }
+
+    // Run the deferred waiting-queue passes now
+    void flushRetries() {
+        if (pendingDeallocations == 0) return;
+        pendingDeallocations = 0;
+        for (int p = 0; p < (int)poolList.size(); p++) {
+            if (!poolList[p].retryPending) continue;
+            poolList[p].retryPending = false;
+            retryWaiting(p);
+        }
+    }
+
+    // Bound every pool's waiting queue to `capacity` jobs (0 = unbounded) and choose what
+    // happens to jobs beyond it. OVERFLOW_SPILL needs a store (without one it rejects); the
+    // store must outlive the allocator. Raising the capacity takes spilled jobs back at once.
+    void setQueueLimit(int capacity, OverflowPolicy policy, SpillStore *store = nullptr) {
+        queueLimit = std::max(capacity, 0);
+        overflow = policy;
+        spillStore = store;
+        for (int p = 0; p < (int)poolList.size(); p++) refillFromSpill(p, 0);
+    }
+    int queueCapacity() const { return queueLimit; }
+    OverflowPolicy overflowPolicy() const { return overflow; }
+
+    // How full a pool's waiting queue is: waiting jobs (spilled ones included) over the
+    // capacity, so 1 means full and more than 1 means jobs are spilling. 0 when unbounded.
+    // Callers can throttle submissions to a pool as this approaches 1.
+    double queuePressure(int poolIndex) const {
+        if (queueLimit == 0) return 0.0;
+        const MemoryPool &pool = poolList[poolIndex];
+        return (double)(waitingJobs(pool) + pool.spilledJobs) / queueLimit;
+    }
+
+    // Whether deallocations are waiting for their coalesced retry pass
+    bool retriesPending() const { return pendingDeallocations > 0; }
+
+    // Nanoseconds until the open coalescing window reaches its time limit (0 if it already
+    // has), or -1 if no window with a time limit is open. Lets an event loop sleep until then.
+    long long retryWindowRemainingNs() const {
+        if (pendingDeallocations == 0 || coalesceDelayNs == 0) return -1;
+        auto age = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - windowStart);
+        return std::max(coalesceDelayNs - (long long)age.count(), 0LL);
+    }
+
+    // Close the coalescing window if it has reached its time limit, without waiting for
+    // another deallocation to notice. Returns whether it was closed.
+    bool flushRetriesIfExpired() {
+        if (retryWindowRemainingNs() != 0) return false;
+        flushRetries();
+        return true;
+    }
+
+    // Switch backfilling mode; existing reservations are released so the new mode starts clean
+    void setBackfillMode(BackfillMode mode) {
+        for (auto &pool : poolList) releaseReservations(pool);
+        backfill = mode;
+    }
+    BackfillMode backfillMode() const { return backfill; }
+
+    void setRoutingPolicy(RoutingPolicy policy) { routing = policy; }
+    RoutingPolicy routingPolicy() const { return routing; }
+
+    // Switch between plain and tiered best fit (see PlacementMode). Jobs already placed stay
+    // where they are; with promotion they move up as faster partitions are freed.
+    void setPlacementMode(PlacementMode mode) {
+        placement = mode;
+        for (auto &pool : poolList) {
+            pool.tiered = pool.fitIndex.byTier = (mode != PLACE_BEST_FIT);
+            pool.fitIndex.stale = true;
+            if (mode != PLACE_TIERED_PROMOTE) pool.promotionCandidates.clear();
+        }
+    }
+    PlacementMode placementMode() const { return placement; }
+
+    // Relative cost of accessing memory in a tier (tier 0 costs 1 by default and each
+    // slower tier twice the one above it). Only used for reporting.
+    void setTierCost(int tier, double cost) { tierCosts[tier] = cost; }
+    double tierCost(int tier) const { return tierCosts[tier]; }
+
+    // Estimated access cost of a pool's running jobs: their memory weighted by the cost of
+    // the tier it lives in, per unit of memory (1 when everything is in a tier of cost 1).
+    // 0 when nothing runs.
+    double averageAccessCost(int poolIndex) const {
+        const MemoryPool &pool = poolList[poolIndex];
+        double weighted = 0;
+        long long memory = 0;
+        for (int t = 0; t < (int)pool.tierUsage.size(); t++) {
+            weighted += pool.tierUsage[t].jobMemory * tierCosts[t];
+            memory += pool.tierUsage[t].jobMemory;
+        }
+        return memory == 0 ? 0.0 : weighted / memory;
+    }
+
+    // Register a function called with every decision (see AllocatorEvent)
+    void addObserver(AllocatorObserver observer) { observers.push_back(std::move(observer)); }
+
+    // All pools, in creation order (a deque, so references stay valid when a pool is added)
+    const std::deque<MemoryPool> &pools() const { return poolList; }
+
+    // Logical clock, advanced once per allocate/deallocate request
+    long long tick() const { return schedulerTick; }
+
+    // Effective (aged) priority of a waiting job at the current tick
+    long long effectivePriority(const Job &j) const {
+        return j.priority + (schedulerTick - j.enqueueTick) / AGING_INTERVAL;
+    }
+
+    // Total number of partitions over all pools
+    long long totalPartitions() const {
+        long long total = 0;
+        for (auto &pool : poolList) total += pool.memory.size();
+        return total;
+    }
+
+    // Per-operation latency (nanoseconds). deallocate covers freeing the partition only;
+    // the waiting-queue pass it triggers is recorded under retryLatency.
+    const LatencyHistogram &allocateLatency() const { return allocateHistogram; }
+    const LatencyHistogram &deallocateLatency() const { return deallocateHistogram; }
+    const LatencyHistogram &retryLatency() const { return retryHistogram; }
+
+private:
+    std::deque<MemoryPool> poolList;
+    long long schedulerTick = 0;
+    BackfillMode backfill = BACKFILL_NONE;
+    RoutingPolicy routing = ROUTE_BEST_FIT;
+    PlacementMode placement = PLACE_BEST_FIT;
+    double tierCosts[MAX_TIERS] = {1, 2, 4, 8, 16, 32, 64, 128};
+    std::vector<AllocatorObserver> observers;
+    int coalesceCount = 1;             // Deallocations per coalescing window
+    long long coalesceDelayNs = 0;     // Longest a window stays open (0 = no limit)
+    int pendingDeallocations = 0;      // Deallocations in the open window
+    int queueLimit = 0;                // Waiting jobs per pool (0 = unbounded)
+    OverflowPolicy overflow = OVERFLOW_REJECT;
+    SpillStore *spillStore = nullptr;  // Where OVERFLOW_SPILL puts jobs (not owned)
+    std::chrono::steady_clock::time_point windowStart; // When the open window's first deallocation came
+    std::unordered_map<Placement, Placement, PlacementHash> movedTo;   // Handle given out for a promoted job -> where it runs now
+    std::unordered_map<Placement, Placement, PlacementHash> movedFrom; // Where a promoted job runs now -> the handle given out
+    LatencyHistogram allocateHistogram;
+    LatencyHistogram deallocateHistogram;
+    LatencyHistogram retryHistogram;
+
+    void notify(AllocatorEventType type, Placement placement, const Job &job) {
+        for (auto &observer : observers) observer({type, placement, job.jobNumber, job.jobSize});
+    }
+
+    // Add a job to a pool's waiting queue heap
+    void pushWaiting(MemoryPool &pool, Job job) {
+        job.enqueueTick = schedulerTick;
+        pool.smallestWaiting = std::min(pool.smallestWaiting, job.jobSize);
+        pool.waitingQueue.push_back(job);
+        std::push_heap(pool.waitingQueue.begin(), pool.waitingQueue.end(), waitsBehind);
+    }
+
+    // Jobs counting towards a pool's queue capacity (the heap and the reservation holders)
+    static long long waitingJobs(const MemoryPool &pool) {
+        return (long long)pool.waitingQueue.size() + pool.reservations.size();
+    }
+
+    // Remove the job that has waited longest (lowest job number on ties) from a pool's heap.
+    // O(capacity), and only run when the queue overflows. Returns false if the heap is empty.
+    static bool dropOldest(MemoryPool &pool, Job &dropped) {
+        auto &queue = pool.waitingQueue;
+        if (queue.empty()) return false;
+        auto oldest = std::min_element(queue.begin(), queue.end(), [](const Job &a, const Job &b) {
+            return a.enqueueTick != b.enqueueTick ? a.enqueueTick < b.enqueueTick : a.jobNumber < b.jobNumber;
+        });
+        dropped = *oldest;
+        *oldest = queue.back();
+        queue.pop_back();
+        std::make_heap(queue.begin(), queue.end(), waitsBehind);
+        return true;
+    }
+
+    // Move spilled jobs back into a pool's heap while it is below capacity (`held` jobs
+    // taken out of the heap for the current pass count as still in it)
+    void refillFromSpill(int poolIndex, int held) {
+        MemoryPool &pool = poolList[poolIndex];
+        while (pool.spilledJobs > 0 && spillStore != nullptr &&
+               (queueLimit == 0 || waitingJobs(pool) + held < queueLimit)) {
+            Job job = spillStore->pop(poolIndex);
+            pool.spilledJobs--;
+            pool.smallestWaiting = std::min(pool.smallestWaiting, job.jobSize);
+            pool.waitingQueue.push_back(job);
+            std::push_heap(pool.waitingQueue.begin(), pool.waitingQueue.end(), waitsBehind);
+        }
+    }
+
+    // Remove and return the waiting job with the highest aged priority
+    static Job popWaiting(MemoryPool &pool) {
+        std::pop_heap(pool.waitingQueue.begin(), pool.waitingQueue.end(), waitsBehind);
+        Job job = pool.waitingQueue.back();
+        pool.waitingQueue.pop_back();
+        return job;
+    }
+
+    // Index of the partition of a pool holding a job, or -1
+    static int findJob(const MemoryPool &pool, int jobNumber) {
+        for (int index = 0; index < (int)pool.memory.size(); index++) {
+            const Partition &p = pool.memory[index];
+            if (!p.isFree() && p.jobNumber == jobNumber) return index; // Must be used and match job
+        }
+        return -1;
+    }
+
+    // Find the best-fitting free partition of a pool for a job (smallest leftover space) among
+    // partitions first..last (indices, inclusive), lowest index on ties.
+    // Partitions reserved for another job are skipped, so backfilled jobs never take them;
+    // the job's own reserved partition is weighed against the best unreserved one.
+    // Returns the partition index, or -1 if no free partition is large enough
+    static int findBestFitInRange(MemoryPool &pool, const Job &job, int first, int last) {
+        auto &memory = pool.memory;
+        if (pool.fitIndex.stale) pool.fitIndex.rebuild(memory, pool.info);
+        int bestIndex = pool.fitIndex.query(memory, pool.info, job.jobSize, first, last);
+
+        if (!pool.reservations.empty()) {
+            int own = reservedPartitionOf(pool, job.jobNumber);
+            if (own >= first && own <= last && memory[own].isFree() && memory[own].size >= job.jobSize &&
+                (bestIndex == -1 || pool.fitRank(own) < pool.fitRank(bestIndex) ||
+                 (pool.fitRank(own) == pool.fitRank(bestIndex) && own < bestIndex)))
+                bestIndex = own;
+        }
+        return bestIndex;
+    }
+
+    // Best fit over the whole pool
+    static int findBestFit(MemoryPool &pool, const Job &job) {
+        return findBestFitInRange(pool, job, 0, (int)pool.memory.size() - 1);
+    }
+
+    // Assign a job to the partition at the given index of a pool
+    static void placeJob(MemoryPool &pool, int index, const Job &job) {
+        auto &memory = pool.memory;
+        memory[index].jobNumber = job.jobNumber; // Mark as used
+        pool.info[index].jobSize = job.jobSize;
+        pool.info[index].reservedFor = -1; // Any reservation is consumed by the placement
+        pool.fitIndex.update(memory, pool.info, index);
+        pool.tierUsage[pool.info[index].tier].used++;
+        pool.tierUsage[pool.info[index].tier].jobMemory += job.jobSize;
+        pool.freePartitions--;
+        pool.jobsPlaced++;
+        pool.totalInternalFragment += pool.internalFragment(index);
+        pool.utilizationSum += ((double)job.jobSize / memory[index].size) * 100;
+    }
+
+    // Reserve for a blocked job the partition it will get next: the smallest unreserved
+    // partition of its pool large enough for it (lowest index on ties). Returns false if none exists.
+    // Used partitions count too, which the index does not track, so this is a linear search
+    // (split over threads on large pools).
+    static bool reservePartitionFor(MemoryPool &pool, const Job &job) {
+        auto &memory = pool.memory;
+        int bestIndex = parallelBestFit((int)memory.size(), [&pool, &job](int i) {
+            return pool.info[i].reservedFor == -1 && pool.memory[i].size >= job.jobSize;
+        }, [&pool](int i) { return pool.fitRank(i); });
+        if (bestIndex == -1) return false;
+
+        pool.info[bestIndex].reservedFor = job.jobNumber;
+        pool.fitIndex.update(memory, pool.info, bestIndex);
+        pool.reservations.push_back({job, bestIndex});
+        return true;
+    }
+
+    // Drop every reservation of a pool and return the blocked jobs to its waiting queue heap
+    static void releaseReservations(MemoryPool &pool) {
+        for (auto &r : pool.reservations) {
+            pool.info[r.partitionIndex].reservedFor = -1;
+            pool.fitIndex.update(pool.memory, pool.info, r.partitionIndex);
+            pool.smallestWaiting = std::min(pool.smallestWaiting, r.job.jobSize);
+            pool.waitingQueue.push_back(r.job);
+            std::push_heap(pool.waitingQueue.begin(), pool.waitingQueue.end(), waitsBehind);
+        }
+        pool.reservations.clear();
+    }
+
+    // Choose the pool for a job and the partition it gets there (index -1 = it has to wait),
+    // searching partitions first..last of each pool.
+    // An explicit affinity (a pool index) always wins. Otherwise the routing policy decides
+    // among the pools that can place the job now (earlier pool on ties). A job no pool can
+    // place right now waits in the least busy pool with a partition large enough for it,
+    // or in the first pool if none has one.
+    Placement routeJob(const Job &job, int affinity, int first, int last) {
+        if (affinity >= 0) return {affinity, findBestFitInRange(poolList[affinity], job, first, last)};
+        if (routing == ROUTE_AFFINITY) return {0, findBestFitInRange(poolList[0], job, first, last)};
+
+        Placement best = {-1, -1};
+        long long bestLeftover = LLONG_MAX;
+        double bestBusy = 2.0;
+        for (int p = 0; p < (int)poolList.size(); p++) {
+            int index = findBestFitInRange(poolList[p], job, first, last);
+            if (index == -1) continue;
+            if (routing == ROUTE_BEST_FIT) {
+                long long leftover = poolList[p].fitRank(index) - job.jobSize; // Faster tiers first when tiered
+                if (leftover < bestLeftover) { bestLeftover = leftover; best = {p, index}; }
+            } else {
+                double busy = poolBusyFraction(poolList[p]);
+                if (busy < bestBusy) { bestBusy = busy; best = {p, index}; }
+            }
+        }
+        if (best.pool != -1) return best;
+
+        // Nowhere to go right now: wait where the job can eventually fit
+        int waitPool = 0;
+        bestBusy = 2.0;
+        for (int p = 0; p < (int)poolList.size(); p++) {
+            if (poolList[p].largestPartition >= job.jobSize && poolBusyFraction(poolList[p]) < bestBusy) {
+                bestBusy = poolBusyFraction(poolList[p]);
+                waitPool = p;
+            }
+        }
+        return {waitPool, -1};
+    }
+
+    // Place a job taken from the waiting queue and record how long it waited
+    void placeWaitingJob(MemoryPool &pool, int index, const Job &job) {
+        placeJob(pool, index, job);
+        pool.maxWaitTicks = std::max(pool.maxWaitTicks, schedulerTick - job.enqueueTick);
+    }
+
+    // Whether a blocked job may reserve a partition under the current backfilling mode
+    bool mayReserve(const MemoryPool &pool) const {
+        return backfill == BACKFILL_CONSERVATIVE || (backfill == BACKFILL_EASY && pool.reservations.empty());
+    }
+
+    // Whether a waiting-queue pass could place or reserve anything. No job can be placed when
+    // every free partition is smaller than the smallest waiting job (and no reservation holder
+    // has its own partition free or fits elsewhere); a pass is then only worth running if it
+    // would make a new backfill reservation.
+    bool waitingPassUseful(MemoryPool &pool) {
+        if (pool.freePartitions == 0) return false;
+        if (pool.fitIndex.stale) pool.fitIndex.rebuild(pool.memory, pool.info);
+        int maxFree = pool.fitIndex.maxAvailableSize();
+
+        for (auto &r : pool.reservations)
+            if (pool.memory[r.partitionIndex].isFree() || r.job.jobSize <= maxFree) return true;
+        if (pool.waitingQueue.empty()) return false;
+        if (pool.smallestWaiting <= maxFree) return true;
+        return mayReserve(pool);
+    }
+
+    // Try allocating jobs from a pool's waiting queue (called after deallocation)
+    // Jobs holding a reservation go first. The remaining jobs are taken from the heap in
+    // aged-priority order; the pass stops as soon as no free partition is left, so only the
+    // jobs that can still compete are examined. With backfilling enabled, a job that does not
+    // fit reserves the partition it will get next and later jobs may only use other partitions.
+    // Waiting jobs stay in the pool they were routed to, so only that pool is examined.
+    // The pass is skipped when it cannot change anything (see waitingPassUseful).
+    void tryAllocateWaiting(int poolIndex) {
+        MemoryPool &pool = poolList[poolIndex];
+        auto &memory = pool.memory;
+        if (pool.waitingQueue.empty() && pool.reservations.empty()) return; // Nothing to do if queue is empty
+        if (!waitingPassUseful(pool)) return;
+
+        LatencyTimer timer(retryHistogram);
+        std::vector<int> placed; // Partitions filled in this pass, reported once the pass is timed
+
+        // Jobs holding a reservation take their reserved partition (or any better free one)
+        for (int r = 0; r < (int)pool.reservations.size() && pool.freePartitions > 0;) {
+            Job j = pool.reservations[r].job;
+            int bestIndex = findBestFit(pool, j);
+            if (bestIndex == -1) { r++; continue; }
+
+            int reserved = pool.reservations[r].partitionIndex;
+            pool.info[reserved].reservedFor = -1;
+            pool.fitIndex.update(memory, pool.info, reserved);
+            pool.reservations.erase(pool.reservations.begin() + r);
+            placeWaitingJob(pool, bestIndex, j);
+            placed.push_back(bestIndex);
+        }
+
+        std::vector<Job> blocked; // Jobs examined in this pass that still can't be allocated
+        int smallestBlocked = INT_MAX;
+
+        while (pool.freePartitions > 0) {
+            if (pool.spilledJobs > 0) refillFromSpill(poolIndex, (int)blocked.size());
+            if (pool.waitingQueue.empty()) break;
+            Job j = popWaiting(pool);
+            int bestIndex = findBestFit(pool, j);
+
+            if (bestIndex != -1) {
+                placeWaitingJob(pool, bestIndex, j);
+                placed.push_back(bestIndex);
+                continue;
+            }
+
+            // A blocked job reserves its next partition (EASY: only the first one)
+            if (mayReserve(pool) && reservePartitionFor(pool, j)) continue;
+
+            // If still no fit, put it back after the pass (keeping its original enqueue tick)
+            blocked.push_back(j);
+            smallestBlocked = std::min(smallestBlocked, j.jobSize);
+        }
+
+        // Every job left in the heap was examined, so the bound can be tightened
+        if (pool.waitingQueue.empty()) pool.smallestWaiting = smallestBlocked;
+
+        // Return the blocked jobs to the heap
+        for (auto &j : blocked) {
+            pool.waitingQueue.push_back(j);
+            std::push_heap(pool.waitingQueue.begin(), pool.waitingQueue.end(), waitsBehind);
+        }
+        if (pool.spilledJobs > 0) refillFromSpill(poolIndex, 0); // Fill the room the placed jobs left
+        timer.stop();
+
+        for (int index : placed)
+            notify(EVENT_WAKEUP, {poolIndex, index, pool.info[index].generation},
+                   {memory[index].jobNumber, pool.info[index].jobSize, 0, 0});
+    }
+
+    // Take the job off the partition at the given index of a pool: remove its share from the
+    // running totals and reset the partition to the free state
+    static void freePartition(MemoryPool &pool, int index) {
+        Partition &p = pool.memory[index];
+        PartitionInfo &info = pool.info[index];
+        pool.totalInternalFragment -= pool.internalFragment(index);
+        pool.utilizationSum -= ((double)info.jobSize / p.size) * 100;
+        pool.tierUsage[info.tier].used--;
+        pool.tierUsage[info.tier].jobMemory -= info.jobSize;
+
+        p.jobNumber = -1;
+        info.jobSize = 0;
+        info.generation++; // Invalidate the handle of the job that just left
+        pool.freePartitions++;
+        pool.fitIndex.update(pool.memory, pool.info, index);
+    }
+
+    // Whether any job runs in a tier slower than the given one
+    static bool slowerTierUsed(const MemoryPool &pool, int tier) {
+        for (int t = tier + 1; t < (int)pool.tierUsage.size(); t++)
+            if (pool.tierUsage[t].used > 0) return true;
+        return false;
+    }
+
+    // Offer each freed partition that is still available after the waiting-queue pass to the
+    // jobs running in slower tiers. The one that fits it best moves up: the slowest tier first,
+    // then the largest job (least leftover), lowest index on ties. The partition it leaves is
+    // offered to the waiting jobs and then to tiers slower still, so a free goes down the
+    // tiers at most once. Finding the job is a linear search (split over threads on large pools).
+    // The handle the job was given is forwarded to its new partition (see deallocateHandle).
+    void promoteJobs(int poolIndex) {
+        MemoryPool &pool = poolList[poolIndex];
+        while (!pool.promotionCandidates.empty()) {
+            int target = pool.promotionCandidates.back();
+            pool.promotionCandidates.pop_back();
+            int tier = pool.info[target].tier, size = pool.memory[target].size;
+            if (!BestFitIndex::available(pool.memory, pool.info, target) || !slowerTierUsed(pool, tier)) continue;
+
+            int from = parallelBestFit((int)pool.memory.size(), [&pool, tier, size](int i) {
+                return !pool.memory[i].isFree() && pool.info[i].tier > tier && pool.info[i].jobSize <= size;
+            }, [&pool](int i) { return -(((long long)pool.info[i].tier << 32) | pool.info[i].jobSize); });
+            if (from == -1) continue;
+
+            Job job = {pool.memory[from].jobNumber, pool.info[from].jobSize, 0, 0};
+            Placement left = {poolIndex, from, pool.info[from].generation};
+            freePartition(pool, from);
+            placeJob(pool, target, job);
+            pool.jobsPlaced--; // Moved, not placed again
+            pool.jobsPromoted++;
+            Placement now = {poolIndex, target, pool.info[target].generation};
+
+            // Forward the job's original handle, which is the old one unless it moved before
+            Placement issued = left;
+            auto earlier = movedFrom.find(left);
+            if (earlier != movedFrom.end()) {
+                issued = earlier->second;
+                movedFrom.erase(earlier);
+            }
+            movedTo[issued] = now;
+            movedFrom[now] = issued;
+            notify(EVENT_PROMOTE, now, job);
+
+            tryAllocateWaiting(poolIndex);
+            pool.promotionCandidates.push_back(from);
+        }
+    }
+
+    // Drop the forwarding of a promoted job's handle once the job leaves (no-op for others)
+    void forgetMove(Placement current) {
+        auto it = movedFrom.find(current);
+        if (it == movedFrom.end()) return;
+        movedTo.erase(it->second);
+        movedFrom.erase(it);
+    }
+
+    // What a deallocation leaves to do in a pool: the waiting-queue pass, then promotions
+    void retryWaiting(int poolIndex) {
+        tryAllocateWaiting(poolIndex);
+        if (!poolList[poolIndex].promotionCandidates.empty()) promoteJobs(poolIndex);
+    }
+
+    // Free the partition at the given index of a pool and retry that pool's waiting jobs.
+    // The timer is stopped once the partition is free, before observers run.
+    void releasePartition(int poolIndex, int index, LatencyTimer &timer) {
+        MemoryPool &pool = poolList[poolIndex];
+        Job job = {pool.memory[index].jobNumber, pool.info[index].jobSize, 0, 0};
+        uint32_t generation = pool.info[index].generation;
+
+        // Add to deallocated list for tracking
+        pool.deallocatedJobs.push_back(job);
+        pool.jobsDeallocated++;
+        freePartition(pool, index);
+        if (!movedFrom.empty()) forgetMove({poolIndex, index, generation});
+        if (placement == PLACE_TIERED_PROMOTE) pool.promotionCandidates.push_back(index);
+        timer.stop();
+        notify(EVENT_DEALLOCATE, {poolIndex, index, generation}, job);
+
+        // Try to allocate waiting jobs now that space is free (or once the window closes)
+        if (coalesceCount == 1) {
+            retryWaiting(poolIndex);
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (pendingDeallocations++ == 0) windowStart = now;
+        pool.retryPending = true;
+        if (pendingDeallocations >= coalesceCount ||
+            (coalesceDelayNs > 0 && now - windowStart >= std::chrono::nanoseconds(coalesceDelayNs)))
+            flushRetries();
+    }
+};
+
+#endif
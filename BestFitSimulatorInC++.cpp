@@ -1,250 +1,1990 @@
+// Best Fit memory partition simulator
+// Build: g++ -std=c++20 -O2 -pthread "BestFitSimulatorInC++.cpp" -o bestfit
 #include <iostream>
 #include <vector>
 #include <iomanip>
 #include <string>
 #include <climits>
 #include <limits> // Added for INT_MAX to replace magic numbers
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <memory>
+#include <mutex>
+#include <cerrno>
+#include <csignal>
+#include <coroutine>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include "BestFitAllocator.hpp"
 using namespace std;
 
-// Struct to represent a memory partition (a block of memory)
-struct Partition {
-    int id;              // Unique identifier for the partition (e.g., 0, 1, 2...)
-    int size;            // Total size of the partition (e.g., in KB or units)
-    bool isFree;         // True if the partition is free (available), false if allocated
-    int jobNumber;       // The job ID assigned to this partition (-1 if free)
-    int jobSize;         // The size of the job allocated here (0 if free)
-    int internalFragment; // Wasted space in this partition (size - jobSize; 0 if free)
+// The allocator behind every mode (partitions, queues, routing, latency); this file is the
+// command-line front end around it and does all of the printing
+BestFitAllocator bestFit;
+const deque<MemoryPool> &pools = bestFit.pools();
+
+bool quietMode = false; // Suppress the per-operation messages (--quiet)
+
+// How a partition is named in messages; the pool is only mentioned when there are several
+string partitionName(const MemoryPool &pool, int index) {
+    string name = "Partition " + to_string(index + 1);
+    if (pools.size() > 1) name += " of pool " + pool.name;
+    return name;
+}
+
+// Print the p50/p90/p99/p99.9/max summary of each operation's latency
+void showLatencySummary() {
+    cout << "Latency (ns)          Count       p50       p90       p99     p99.9       Max\n";
+    auto row = [](const char *name, const LatencyHistogram &h) {
+        cout << left << setw(20) << name << right
+             << setw(7) << h.total
+             << setw(10) << h.percentile(0.50)
+             << setw(10) << h.percentile(0.90)
+             << setw(10) << h.percentile(0.99)
+             << setw(10) << h.percentile(0.999)
+             << setw(10) << h.maxValue << left << "\n";
+    };
+    row("allocateJob", bestFit.allocateLatency());
+    row("deallocateJob", bestFit.deallocateLatency());
+    row("tryAllocateWaiting", bestFit.retryLatency());
+}
+
+// Print every non-empty bucket of each latency histogram with its cumulative percentage
+void dumpLatencyHistograms() {
+    auto dump = [](const char *name, const LatencyHistogram &h) {
+        cout << "\n" << name << " (" << h.total << " samples)\n";
+        if (h.total == 0) return;
+        cout << right << setw(14) << "From (ns)" << setw(14) << "To (ns)"
+             << setw(12) << "Count" << setw(12) << "Cumul. %" << "\n";
+        uint64_t seen = 0;
+        for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+            if (h.counts[b] == 0) continue;
+            seen += h.counts[b];
+            cout << setw(14) << LatencyHistogram::bucketLow(b)
+                 << setw(14) << LatencyHistogram::bucketHigh(b)
+                 << setw(12) << h.counts[b]
+                 << setw(12) << fixed << setprecision(3) << (100.0 * seen / h.total) << "\n";
+        }
+        cout << left;
+    };
+    dump("allocateJob", bestFit.allocateLatency());
+    dump("deallocateJob", bestFit.deallocateLatency());
+    dump("tryAllocateWaiting", bestFit.retryLatency());
+}
+
+
+// One recorded decision: when it happened, which pool and partition (ID, 0 if none) and which job
+struct TraceEvent {
+    uint64_t timestampNs;
+    int32_t partitionId;
+    int32_t jobNumber;
+    AllocatorEventType type;
+    uint16_t pool;
 };
 
-// Struct to represent a job (a process requesting memory)
-struct Job {
-    int jobNumber; // Unique ID for the job (auto-incremented)
-    int jobSize;   // Memory size required by the job
+// Ring buffer of trace events written by a single thread. The writer never blocks: it
+// fills the next slot and publishes it by advancing head, overwriting the oldest event
+// once the ring is full. Readers use head to find the valid window (see exportTrace).
+struct TraceRing {
+    static const uint64_t CAPACITY = 1 << 16; // Events kept per thread (must be a power of two)
+    TraceEvent events[CAPACITY];
+    atomic<uint64_t> head{0}; // Number of events ever written
+    int threadIndex = 0;      // Small per-thread ID used as the trace "tid"
 };
 
-// Global vectors to store data:
-// - memory: List of all partitions (the main memory pool)
-// - waitingQueue: Jobs waiting for allocation if no suitable partition is free
-// - deallocatedJobs: Jobs that have been deallocated (for historical tracking)
-vector<Partition> memory;
-vector<Job> waitingQueue;
-vector<Job> deallocatedJobs;
+atomic<bool> traceEnabled{false};        // Checked before recording; off = one relaxed load per event
+string tracePath;                        // Where the trace is written on exit ("" = not requested)
+chrono::steady_clock::time_point traceStart = chrono::steady_clock::now();
+mutex traceRingsMutex;                   // Guards traceRings; taken once per thread, at registration
+vector<unique_ptr<TraceRing>> traceRings; // Owned here so rings outlive their threads
 
-// Function to display the current status of memory, including a table and metrics
-void showStatus() {
-    // Define column widths as constants for better readability and maintainability
-    const int col1 = 12, col2 = 12, col3 = 12, col4 = 12, col5 = 12, col6 = 18;
-    const int space = 2; // Space between columns
+// Slow path of traceEvent: find (or register) this thread's ring and append the event
+void recordTraceEvent(AllocatorEventType type, int pool, int partitionId, int jobNumber) {
+    thread_local TraceRing *ring = nullptr;
+    if (ring == nullptr) {
+        lock_guard<mutex> lock(traceRingsMutex);
+        traceRings.push_back(make_unique<TraceRing>());
+        ring = traceRings.back().get();
+        ring->threadIndex = (int)traceRings.size();
+    }
+
+    uint64_t n = ring->head.load(memory_order_relaxed);
+    TraceEvent &e = ring->events[n & (TraceRing::CAPACITY - 1)];
+    e.timestampNs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - traceStart).count();
+    e.partitionId = partitionId;
+    e.jobNumber = jobNumber;
+    e.type = type;
+    e.pool = (uint16_t)pool;
+    ring->head.store(n + 1, memory_order_release);
+}
+
+// Record an allocator decision if tracing is enabled
+inline void traceEvent(AllocatorEventType type, int pool, int partitionId, int jobNumber) {
+    if (traceEnabled.load(memory_order_relaxed)) recordTraceEvent(type, pool, partitionId, jobNumber);
+}
+
+// Write every buffered event as Chrome Trace Event JSON (open in Perfetto or chrome://tracing).
+// Each ring is copied between two reads of its head; slots the writer may have overwritten
+// during the copy are dropped, so the export is safe while other threads keep recording.
+bool exportTrace(const string &path) {
+    ofstream out(path);
+    if (!out) return false;
+
+    static const char *names[] = {"allocate", "queue", "wakeup", "deallocate", "reject",
+                                  "queue_full", "drop", "spill", "promote"};
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+
+    lock_guard<mutex> lock(traceRingsMutex);
+    for (auto &ring : traceRings) {
+        uint64_t end = ring->head.load(memory_order_acquire);
+        uint64_t begin = end > TraceRing::CAPACITY ? end - TraceRing::CAPACITY : 0;
+        vector<TraceEvent> copy;
+        for (uint64_t n = begin; n < end; n++) copy.push_back(ring->events[n & (TraceRing::CAPACITY - 1)]);
+
+        uint64_t after = ring->head.load(memory_order_acquire);
+        uint64_t stale = after > TraceRing::CAPACITY ? after - TraceRing::CAPACITY : 0; // First slot still intact
+        for (uint64_t n = max(begin, stale); n < end; n++) {
+            const TraceEvent &e = copy[n - begin];
+            out << (first ? "\n" : ",\n")
+                << "{\"name\":\"" << names[e.type] << "\",\"cat\":\"bestfit\",\"ph\":\"i\",\"s\":\"t\""
+                << ",\"ts\":" << e.timestampNs / 1000 << "." << setw(3) << setfill('0') << e.timestampNs % 1000
+                << setfill(' ') << ",\"pid\":1,\"tid\":" << ring->threadIndex
+                << ",\"args\":{\"job\":" << e.jobNumber << ",\"pool\":\"" << pools[e.pool].name
+                << "\",\"partition\":" << e.partitionId << "}}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+    return (bool)out;
+}
+
+// Name of a backfilling mode, for display
+const char *backfillModeName(BackfillMode mode) {
+    switch (mode) {
+        case BACKFILL_EASY: return "EASY";
+        case BACKFILL_CONSERVATIVE: return "Conservative";
+        default: return "Off";
+    }
+}
+
+// Reusable output buffer: text is formatted into it with to_chars and written to the
+// stream in large blocks, instead of one formatted stream insertion per table cell
+struct OutputBuffer {
+    static const size_t FLUSH_AT = 1 << 16; // Write to the stream once this many bytes are pending
+
+    ostream &out;
+    string buffer;
+
+    explicit OutputBuffer(ostream &o) : out(o) { buffer.reserve(FLUSH_AT + 256); }
+    ~OutputBuffer() { flush(); }
+
+    void flush() {
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    // Called after each complete row or record, so blocks always end on a line boundary
+    void endLine() {
+        buffer += '\n';
+        if (buffer.size() >= FLUSH_AT) flush();
+    }
 
-    // Calculate total table width for drawing borders
-    int tableWidth = col1 + col2 + col3 + col4 + col5 + col6 + (5 * space);
+    void text(const char *s) { buffer += s; }
+    void text(const string &s) { buffer += s; }
+    void chars(char ch, int count) { buffer.append(count, ch); }
 
-    // Lambda function to print a horizontal line (used for table borders)
+    void number(long long v) {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), v);
+        buffer.append(digits, result.ptr - digits);
+    }
+
+    void number(double v, int precision) {
+        char digits[64];
+        auto result = to_chars(digits, digits + sizeof(digits), v, chars_format::fixed, precision);
+        buffer.append(digits, result.ptr - digits);
+    }
+
+    // Left-aligned cells padded to a column width (like setw with left)
+    void cell(const char *s, int width) {
+        size_t start = buffer.size();
+        buffer += s;
+        pad(start, width);
+    }
+    void cell(long long v, int width) {
+        size_t start = buffer.size();
+        number(v);
+        pad(start, width);
+    }
+    void pad(size_t start, int width) {
+        size_t written = buffer.size() - start;
+        if (written < (size_t)width) buffer.append(width - written, ' ');
+    }
+};
+
+// Which rows of the partition table to show
+enum RowFilter { ROWS_ALL, ROWS_USED, ROWS_FREE };
+
+// Column widths of the partition table
+const int COL_ID = 12, COL_SIZE = 12, COL_STATUS = 12, COL_JOB = 12, COL_JOB_SIZE = 12, COL_FRAGMENT = 18;
+const int COL_SPACE = 2; // Space between columns
+const int TABLE_WIDTH = COL_ID + COL_SIZE + COL_STATUS + COL_JOB + COL_JOB_SIZE + COL_FRAGMENT + (5 * COL_SPACE);
+
+// Render the partition table of a pool for partitions first..last (indices, inclusive) that
+// pass the filter. Rows are formatted into one buffer and written in large blocks, so dumping
+// millions of rows is bound by the terminal or pipe rather than by formatting.
+// Returns the internal fragmentation of the rows shown.
+long long renderPartitionTable(const MemoryPool &pool, int first, int last, RowFilter filter) {
+    auto &memory = pool.memory;
+    OutputBuffer out(cout);
     auto line = [&](char ch) {
-        for (int i = 0; i < tableWidth; i++) cout << ch;
-        cout << "\n";
+        out.chars(ch, TABLE_WIDTH);
+        out.endLine();
     };
 
-    cout << "\n";
+    out.endLine();
     line('='); // Top border
 
-    // Print table header with column names
-    cout << left
-         << setw(col1) << "Part. ID" << setw(space) << ""
-         << setw(col2) << "Size" << setw(space) << ""
-         << setw(col3) << "Status" << setw(space) << ""
-         << setw(col4) << "Job No." << setw(space) << ""
-         << setw(col5) << "Job Size" << setw(space) << ""
-         << setw(col6) << "Int.Fragment"
-         << "\n";
+    // Table header with column names
+    out.cell("Part. ID", COL_ID + COL_SPACE);
+    out.cell("Size", COL_SIZE + COL_SPACE);
+    out.cell("Status", COL_STATUS + COL_SPACE);
+    out.cell("Job No.", COL_JOB + COL_SPACE);
+    out.cell("Job Size", COL_JOB_SIZE + COL_SPACE);
+    out.cell("Int.Fragment", COL_FRAGMENT);
+    out.endLine();
 
     line('-'); // Separator line
 
-    // Variables to calculate totals for metrics
-    int totalIF = 0;     // Total internal fragmentation (sum of wasted space in used partitions)
-    int usedCount = 0;   // Number of used partitions (for average calculation)
+    long long shownIF = 0; // Internal fragmentation of the rows shown
 
-    // Loop through each partition and print its details in the table
-    for (auto &p : memory) {
-        // If the partition is used, add its fragmentation to the total and increment used count
-        if (!p.isFree) {
-            totalIF += p.internalFragment;
-            usedCount++;
-        }
+    // Row: ID, Size, Status, Job Number (FREE if free), Job Size (FREE if free), Fragmentation (0 if free)
+    for (int i = max(first, 0); i <= last && i < (int)memory.size(); i++) {
+        const Partition &p = memory[i];
+        if ((filter == ROWS_USED && p.isFree()) || (filter == ROWS_FREE && !p.isFree())) continue;
 
-        // Print the row: ID, Size, Status, Job Number (or -1 if free), Job Size (or -1), Fragmentation (or 0)
-        cout << left
-             << setw(col1) << p.id << setw(space) << ""
-             << setw(col2) << p.size << setw(space) << ""
-             << setw(col3) << (p.isFree ? "FREE" : "USED") << setw(space) << ""
-             << setw(col4) << (p.isFree ? "FREE": to_string(p.jobNumber)) << setw(space) << ""
-             << setw(col5) << (p.isFree ? "FREE" : to_string(p.jobSize)) << setw(space) << ""
-             << setw(col6) << (p.isFree ? 0 : p.internalFragment)
-             << "\n";
+        out.cell(i + 1, COL_ID + COL_SPACE);
+        out.cell(p.size, COL_SIZE + COL_SPACE);
+        out.cell(p.isFree() ? "FREE" : "USED", COL_STATUS + COL_SPACE);
+        if (p.isFree()) {
+            out.cell("FREE", COL_JOB + COL_SPACE);
+            out.cell("FREE", COL_JOB_SIZE + COL_SPACE);
+            out.cell(0LL, COL_FRAGMENT);
+        } else {
+            out.cell(p.jobNumber, COL_JOB + COL_SPACE);
+            out.cell(pool.info[i].jobSize, COL_JOB_SIZE + COL_SPACE);
+            out.cell(pool.internalFragment(i), COL_FRAGMENT);
+            shownIF += pool.internalFragment(i);
+        }
+        out.endLine();
     }
 
     line('-'); // Separator line
 
-    // Print total internal fragmentation, aligned under the last column
-    cout << setw(col1 + col2 + col3 + col4 + col5 + (5 * space)) << ""
-         << "Total: " << totalIF << "\n";
+    // Total internal fragmentation, aligned under the last column
+    out.chars(' ', TABLE_WIDTH - COL_FRAGMENT);
+    out.text("Total: ");
+    out.number(shownIF);
+    out.endLine();
 
     line('='); // Bottom border
+    return shownIF;
+}
+
+// Stream the partitions, waiting queue and deallocation history of every pool as three CSV
+// files (<prefix>_partitions.csv, <prefix>_queue.csv, <prefix>_history.csv), each row starting
+// with the pool name. Rows go through an OutputBuffer straight to the file, so memory use does
+// not grow with the table size. Job columns are left empty for free partitions.
+bool exportStatusCsv(const string &prefix) {
+    {
+        ofstream file(prefix + "_partitions.csv");
+        if (!file) return false;
+        OutputBuffer out(file);
+        out.text("pool,id,size,status,job_number,job_size,internal_fragment,reserved_for,tier");
+        out.endLine();
+        for (auto &pool : pools) for (int i = 0; i < (int)pool.memory.size(); i++) {
+            const Partition &p = pool.memory[i];
+            out.text(pool.name); out.text(",");
+            out.number(i + 1); out.text(",");
+            out.number(p.size); out.text(p.isFree() ? ",FREE," : ",USED,");
+            if (!p.isFree()) { out.number(p.jobNumber); out.text(","); out.number(pool.info[i].jobSize); }
+            else out.text(",");
+            out.text(",");
+            out.number(pool.internalFragment(i)); out.text(",");
+            if (pool.info[i].reservedFor != -1) out.number(pool.info[i].reservedFor);
+            out.text(",");
+            out.number(pool.info[i].tier);
+            out.endLine();
+        }
+        out.flush();
+        if (!file) return false;
+    }
+    {
+        ofstream file(prefix + "_queue.csv");
+        if (!file) return false;
+        OutputBuffer out(file);
+        out.text("pool,position,job_number,job_size,priority,effective_priority,enqueue_tick,reserved_partition");
+        out.endLine();
+        for (auto &pool : pools) {
+            int position = 1;
+            for (auto &j : waitingInServiceOrder(pool)) {
+                out.text(pool.name); out.text(",");
+                out.number(position++); out.text(",");
+                out.number(j.jobNumber); out.text(",");
+                out.number(j.jobSize); out.text(",");
+                out.number(j.priority); out.text(",");
+                out.number(bestFit.effectivePriority(j)); out.text(",");
+                out.number(j.enqueueTick); out.text(",");
+                int reserved = reservedPartitionOf(pool, j.jobNumber);
+                if (reserved != -1) out.number(reserved + 1);
+                out.endLine();
+            }
+        }
+        out.flush();
+        if (!file) return false;
+    }
+    {
+        ofstream file(prefix + "_history.csv");
+        if (!file) return false;
+        OutputBuffer out(file);
+        out.text("pool,job_number,job_size");
+        out.endLine();
+        for (auto &pool : pools) for (auto &j : pool.deallocatedJobs) {
+            out.text(pool.name); out.text(",");
+            out.number(j.jobNumber); out.text(",");
+            out.number(j.jobSize);
+            out.endLine();
+        }
+        out.flush();
+        if (!file) return false;
+    }
+    return true;
+}
+
+// Stream the same data as newline-delimited JSON: one object per line, tagged with "type"
+// ("partition", "waiting" or "deallocated") and carrying its "pool", followed by one "pool"
+// line per pool with its totals and a final "summary" line
+bool exportStatusNdjson(const string &path) {
+    ofstream file(path);
+    if (!file) return false;
+    OutputBuffer out(file);
+
+    // Every record starts with its type and pool
+    auto begin = [&](const char *type, const MemoryPool &pool) {
+        out.text("{\"type\":\""); out.text(type);
+        out.text("\",\"pool\":\""); out.text(pool.name); out.text("\"");
+    };
+
+    for (auto &pool : pools) {
+        for (int i = 0; i < (int)pool.memory.size(); i++) {
+            const Partition &p = pool.memory[i];
+            begin("partition", pool);
+            out.text(",\"id\":"); out.number(i + 1);
+            out.text(",\"size\":"); out.number(p.size);
+            out.text(",\"tier\":"); out.number(pool.info[i].tier);
+            out.text(p.isFree() ? ",\"free\":true" : ",\"free\":false");
+            if (!p.isFree()) {
+                out.text(",\"job_number\":"); out.number(p.jobNumber);
+                out.text(",\"job_size\":"); out.number(pool.info[i].jobSize);
+                out.text(",\"internal_fragment\":"); out.number(pool.internalFragment(i));
+            }
+            if (pool.info[i].reservedFor != -1) {
+                out.text(",\"reserved_for\":"); out.number(pool.info[i].reservedFor);
+            }
+            out.text("}");
+            out.endLine();
+        }
+
+        int position = 1;
+        for (auto &j : waitingInServiceOrder(pool)) {
+            begin("waiting", pool);
+            out.text(",\"position\":"); out.number(position++);
+            out.text(",\"job_number\":"); out.number(j.jobNumber);
+            out.text(",\"job_size\":"); out.number(j.jobSize);
+            out.text(",\"priority\":"); out.number(j.priority);
+            out.text(",\"effective_priority\":"); out.number(bestFit.effectivePriority(j));
+            out.text(",\"enqueue_tick\":"); out.number(j.enqueueTick);
+            int reserved = reservedPartitionOf(pool, j.jobNumber);
+            if (reserved != -1) { out.text(",\"reserved_partition\":"); out.number(reserved + 1); }
+            out.text("}");
+            out.endLine();
+        }
+
+        for (auto &j : pool.deallocatedJobs) {
+            begin("deallocated", pool);
+            out.text(",\"job_number\":"); out.number(j.jobNumber);
+            out.text(",\"job_size\":"); out.number(j.jobSize);
+            out.text("}");
+            out.endLine();
+        }
+    }
+
+    long long partitions = 0, freePartitions = 0, internalFragment = 0;
+    double utilizationSum = 0.0;
+    for (auto &pool : pools) {
+        out.text("{\"type\":\"pool\",\"name\":\""); out.text(pool.name);
+        out.text("\",\"partitions\":"); out.number((long long)pool.memory.size());
+        out.text(",\"free_partitions\":"); out.number(pool.freePartitions);
+        out.text(",\"internal_fragmentation\":"); out.number(pool.totalInternalFragment);
+        out.text(",\"utilization_percent\":");
+        out.number(pool.memory.empty() ? 0.0 : pool.utilizationSum / pool.memory.size(), 4);
+        out.text(",\"spilled\":"); out.number(pool.spilledJobs);
+        out.text("}");
+        out.endLine();
+        partitions += pool.memory.size();
+        freePartitions += pool.freePartitions;
+        internalFragment += pool.totalInternalFragment;
+        utilizationSum += pool.utilizationSum;
+    }
+
+    out.text("{\"type\":\"summary\",\"tick\":"); out.number(bestFit.tick());
+    out.text(",\"pools\":"); out.number((long long)pools.size());
+    out.text(",\"partitions\":"); out.number(partitions);
+    out.text(",\"free_partitions\":"); out.number(freePartitions);
+    out.text(",\"internal_fragmentation\":"); out.number(internalFragment);
+    out.text(",\"utilization_percent\":"); out.number(partitions == 0 ? 0.0 : utilizationSum / partitions, 4);
+    out.text("}");
+    out.endLine();
+
+    out.flush();
+    return (bool)file;
+}
+
+// Name of a routing policy, for display
+const char *routingPolicyName(RoutingPolicy policy) {
+    switch (policy) {
+        case ROUTE_AFFINITY: return "Affinity";
+        case ROUTE_LEAST_UTILIZED: return "Least Utilized";
+        default: return "Best Fit";
+    }
+}
+
+// Name of a placement mode, for display
+const char *placementModeName(PlacementMode mode) {
+    switch (mode) {
+        case PLACE_TIERED: return "Tiered";
+        case PLACE_TIERED_PROMOTE: return "Tiered with Promotion";
+        default: return "Best Fit";
+    }
+}
+
+// Name of an overflow policy, for display
+const char *overflowPolicyName(OverflowPolicy policy) {
+    switch (policy) {
+        case OVERFLOW_DROP_OLDEST: return "Drop Oldest";
+        case OVERFLOW_SPILL: return "Spill";
+        default: return "Reject";
+    }
+}
+
+// Display one pool: its partition table, waiting queue, reservations, history and averages
+void showPoolStatus(int poolIndex) {
+    const MemoryPool &pool = pools[poolIndex];
+    auto &memory = pool.memory;
+    renderPartitionTable(pool, 0, (int)memory.size() - 1, ROWS_ALL);
 
     // Display waiting queue: List jobs waiting for allocation
     cout << "\nWaiting Queue: ";
-    if (waitingQueue.empty()) cout << "None";
+    if (pool.waitingQueue.empty() && pool.reservations.empty()) cout << "None";
     else {
-        for (auto &j : waitingQueue)
-            cout << "[Job " << j.jobNumber << " (" << j.jobSize << ")] ";
+        // The queue is a heap, so print a copy sorted in service order
+        // (jobs holding a reservation are waiting too and are listed with the rest)
+        for (auto &j : waitingInServiceOrder(pool))
+            cout << "[Job " << j.jobNumber << " (" << j.jobSize << ") p"
+                 << bestFit.effectivePriority(j) << "] ";
+    }
+
+    // Display backfill reservations: which blocked job will get which partition next
+    if (!pool.reservations.empty()) {
+        cout << "\nReservations: ";
+        for (auto &r : pool.reservations)
+            cout << "[Job " << r.job.jobNumber << " -> Partition "
+                 << r.partitionIndex + 1 << "] ";
     }
 
     // Display deallocated jobs: List jobs that have been freed
     cout << "\nDeallocated Jobs: ";
-    if (deallocatedJobs.empty()) cout << "None";
+    if (pool.deallocatedJobs.empty()) cout << "None";
     else {
-        for (auto &j : deallocatedJobs)
+        for (auto &j : pool.deallocatedJobs)
             cout << "[Job " << j.jobNumber << "] ";
     }
 
     // Calculate and display average internal fragmentation (as percentage)
     // Avoid division by zero if no partitions are used
-    double avgInternal = (usedCount == 0 ? 0 : (double)totalIF / usedCount);
+    long long usedCount = memory.size() - pool.freePartitions;
+    double avgInternal = (usedCount == 0 ? 0 : (double)pool.totalInternalFragment / usedCount);
 
     cout << "\nAverage Internal Fragmentation: "
          << fixed << setprecision(2) << avgInternal;
 
     // Calculate and display memory utilization (average percentage of partitions used)
-    // For each partition, if used, add (jobSize / size) * 100; then divide by total partitions
-    double utilization = 0.0;
-    for (auto &p : memory) {
-        if (!p.isFree) {
-            utilization += ((double)p.jobSize / p.size) * 100;
-        }
-    }
-    utilization /= memory.size(); // Average across all partitions
+    // utilizationSum already holds (jobSize / size) * 100 summed over used partitions
+    // (an empty pool has nothing to use, so it reports 0)
+    double utilization = memory.empty() ? 0.0 : pool.utilizationSum / memory.size(); // Average across all partitions
 
     cout << "\nMemory Utilization: "
          << fixed << setprecision(2) << utilization << " %\n";
 
+    // Leftover space of the used partitions (a parallel walk on large pools)
+    LeftoverStats leftover = leftoverStats(pool);
+    cout << "Leftover Space: ";
+    if (leftover.used == 0) cout << "None\n";
+    else {
+        const LatencyHistogram &h = leftover.histogram;
+        cout << "min " << leftover.minLeftover << " | p50 " << h.percentile(0.50)
+             << " | p90 " << h.percentile(0.90) << " | p99 " << h.percentile(0.99)
+             << " | max " << h.maxValue << "\n";
+    }
+
+    // Memory tiers: how full each one is and what its jobs cost to access
+    if (pool.tierUsage.size() > 1 || bestFit.placementMode() != PLACE_BEST_FIT) {
+        for (int t = 0; t < (int)pool.tierUsage.size(); t++) {
+            const TierUsage &u = pool.tierUsage[t];
+            if (u.partitions == 0) continue;
+            cout << "Tier " << t << ": " << u.used << "/" << u.partitions << " used | Utilization "
+                 << fixed << setprecision(2) << (u.capacity == 0 ? 0.0 : 100.0 * u.jobMemory / u.capacity)
+                 << " % | Cost " << bestFit.tierCost(t) << "x | Access Cost " << u.jobMemory * bestFit.tierCost(t) << "\n";
+        }
+        cout << "Estimated Access Cost: " << bestFit.averageAccessCost(poolIndex)
+             << " per unit | Promoted: " << pool.jobsPromoted << "\n";
+    }
+}
+
+// One line per pool: partitions, free partitions, waiting jobs, jobs placed and utilization
+void showPoolSummary() {
+    cout << "Pool                Parts      Free   Waiting    Placed    Util %\n";
+    for (auto &pool : pools) {
+        cout << left << setw(16) << pool.name << right
+             << setw(9) << pool.memory.size()
+             << setw(10) << pool.freePartitions
+             << setw(10) << pool.waitingQueue.size() + pool.reservations.size()
+             << setw(10) << pool.jobsPlaced
+             << setw(10) << fixed << setprecision(2)
+             << (pool.memory.empty() ? 0.0 : pool.utilizationSum / pool.memory.size()) << left << "\n";
+    }
+}
+
+// Function to display the current status of memory, including a table and metrics
+// (one section per pool, then a summary of all pools when there are several)
+void showStatus() {
+    auto line = [&](char ch) { cout << string(TABLE_WIDTH, ch) << "\n"; };
+
+    for (int p = 0; p < (int)pools.size(); p++) {
+        if (pools.size() > 1) cout << "\nPool " << pools[p].name;
+        showPoolStatus(p);
+    }
+
+    // Display scheduling metrics: throughput (jobs placed per tick) and the longest wait,
+    // counting jobs that are still waiting
+    long long jobsPlaced = 0, jobsRejected = 0, longestWait = 0;
+    for (auto &pool : pools) {
+        jobsPlaced += pool.jobsPlaced;
+        jobsRejected += pool.jobsRejected;
+        longestWait = max(longestWait, pool.maxWaitTicks);
+        for (auto &j : pool.waitingQueue) longestWait = max(longestWait, bestFit.tick() - j.enqueueTick);
+        for (auto &r : pool.reservations) longestWait = max(longestWait, bestFit.tick() - r.job.enqueueTick);
+    }
+    double throughput = (bestFit.tick() == 0 ? 0 : (double)jobsPlaced / bestFit.tick());
+
+    if (pools.size() > 1) {
+        line('-');
+        showPoolSummary();
+        cout << "Routing Policy: " << routingPolicyName(bestFit.routingPolicy()) << "\n";
+    }
+    if (bestFit.placementMode() != PLACE_BEST_FIT)
+        cout << "Placement: " << placementModeName(bestFit.placementMode()) << "\n";
+    cout << "Backfill Mode: " << backfillModeName(bestFit.backfillMode())
+         << " | Throughput: " << fixed << setprecision(2) << throughput << " jobs/tick"
+         << " | Max Wait: " << longestWait << " ticks"
+         << " | Rejected: " << jobsRejected << "\n";
+
+    // Queue bound, what it turned away and how close each pool is to it
+    if (bestFit.queueCapacity() > 0) {
+        long long queueFull = 0, dropped = 0, spilled = 0;
+        double pressure = 0.0;
+        for (int p = 0; p < (int)pools.size(); p++) {
+            queueFull += pools[p].jobsQueueFull;
+            dropped += pools[p].jobsDropped;
+            spilled += pools[p].jobsSpilled;
+            pressure = max(pressure, bestFit.queuePressure(p));
+        }
+        cout << "Queue Limit: " << bestFit.queueCapacity() << " (" << overflowPolicyName(bestFit.overflowPolicy())
+             << ") | Queue Full: " << queueFull << " | Dropped: " << dropped << " | Spilled: " << spilled
+             << " | Pressure: " << fixed << setprecision(0) << pressure * 100 << " %\n";
+    }
+
+    line('-');
+    showLatencySummary();
+
     line('='); // Final border
 }
 
-// Function to allocate a job using Best Fit algorithm
-void allocateJob(Job job) {
-    int bestIndex = -1;     // Index of the best-fitting partition (-1 if none found)
-    int smallestFit = INT_MAX; // Smallest leftover space (using INT_MAX instead of magic number 999999)
+// Coroutines suspended in allocateAsync until their queued job is placed (by job number),
+// and coroutines ready to run again. Waking only queues the coroutine; the simulation
+// loop resumes it, so allocator calls never re-enter themselves from a wake-up.
+struct AllocationWaiter {
+    coroutine_handle<> handle;
+    Placement *placement; // Where the awaiter receives the pool and partition index
+};
+unordered_map<int, AllocationWaiter> allocationWaiters;
+deque<coroutine_handle<>> readyCoroutines;
+
+// Hand a placed waiting job's partition to the coroutine awaiting it, if any
+void notifyAllocationWaiter(int jobNumber, Placement placement) {
+    if (allocationWaiters.empty()) return;
+    auto it = allocationWaiters.find(jobNumber);
+    if (it == allocationWaiters.end()) return;
+    *it->second.placement = placement;
+    readyCoroutines.push_back(it->second.handle);
+    allocationWaiters.erase(it);
+}
+
+// Report an allocator decision: record it in the trace, wake the coroutine waiting for a
+// queued job, and print the per-operation message unless in quiet mode
+void reportEvent(const AllocatorEvent &e) {
+    const Placement &where = e.placement;
+    int partitionId = where.index >= 0 ? where.index + 1 : 0;
+    traceEvent(e.type, where.pool, partitionId, e.jobNumber);
+    if (e.type == EVENT_WAKEUP) notifyAllocationWaiter(e.jobNumber, where);
+    if (e.type == EVENT_DROP) notifyAllocationWaiter(e.jobNumber, {where.pool, INDEX_QUEUE_FULL});
+    if (quietMode) return;
+
+    const MemoryPool &pool = pools[where.pool];
+    switch (e.type) {
+        case EVENT_ALLOCATE:
+            cout << "\nJob " << e.jobNumber << " allocated to " << partitionName(pool, where.index) << " (Best Fit).\n";
+            break;
+        case EVENT_QUEUE:
+            cout << "\nNo available partition for Job " << e.jobNumber;
+            if (pools.size() > 1) cout << " in pool " << pool.name;
+            cout << " → Added to waiting queue.\n";
+            break;
+        case EVENT_WAKEUP:
+            cout << "\nWaiting Job " << e.jobNumber << " allocated to " << partitionName(pool, where.index) << ".\n";
+            break;
+        case EVENT_DEALLOCATE:
+            cout << "\nJob " << e.jobNumber << " deallocated from " << partitionName(pool, where.index) << "\n";
+            break;
+        case EVENT_PROMOTE:
+            cout << "\nJob " << e.jobNumber << " promoted to " << partitionName(pool, where.index)
+                 << " (tier " << (int)pool.info[where.index].tier << ").\n";
+            break;
+        case EVENT_REJECT:
+            cout << "\nJob " << e.jobNumber << " (" << e.jobSize << ") is larger than every partition";
+            if (pools.size() > 1) cout << " of pool " << pool.name;
+            cout << " → Rejected.\n";
+            break;
+        case EVENT_QUEUE_FULL:
+        case EVENT_DROP:
+        case EVENT_SPILL:
+            cout << "\nWaiting queue";
+            if (pools.size() > 1) cout << " of pool " << pool.name;
+            cout << " is full → ";
+            if (e.type == EVENT_QUEUE_FULL) cout << "Job " << e.jobNumber << " rejected.\n";
+            else if (e.type == EVENT_DROP) cout << "oldest waiting Job " << e.jobNumber << " dropped.\n";
+            else cout << "Job " << e.jobNumber << " spilled to disk.\n";
+            break;
+    }
+}
+
+// Spill store backed by one unnamed temporary file per pool (deleted automatically on exit).
+// Jobs are appended as raw records and read back from a moving offset; a file is emptied
+// again whenever it has been read to the end, so it only grows while the overflow lasts.
+struct FileSpillStore : SpillStore {
+    struct SpillFile {
+        FILE *file = nullptr;
+        long long written = 0; // Records appended
+        long long read = 0;    // Records taken back
+    };
+    vector<SpillFile> files;
+
+    ~FileSpillStore() {
+        for (auto &f : files) if (f.file != nullptr) fclose(f.file);
+    }
+
+    // A spill file is a lost job if it fails, so give up loudly
+    static void fail(const char *what) {
+        perror(what);
+        exit(1);
+    }
+
+    SpillFile &fileOf(int pool) {
+        if ((int)files.size() <= pool) files.resize(pool + 1);
+        SpillFile &f = files[pool];
+        if (f.file == nullptr && (f.file = tmpfile()) == nullptr) fail("spill file");
+        return f;
+    }
+
+    void push(int pool, const Job &job) override {
+        SpillFile &f = fileOf(pool);
+        if (fseeko(f.file, (off_t)(f.written * sizeof(Job)), SEEK_SET) != 0 ||
+            fwrite(&job, sizeof(Job), 1, f.file) != 1) fail("spill write");
+        f.written++;
+    }
+
+    Job pop(int pool) override {
+        SpillFile &f = fileOf(pool);
+        Job job;
+        if (fseeko(f.file, (off_t)(f.read * sizeof(Job)), SEEK_SET) != 0 ||
+            fread(&job, sizeof(Job), 1, f.file) != 1) fail("spill read");
+        if (++f.read == f.written) {
+            f.read = f.written = 0;
+            if (ftruncate(fileno(f.file), 0) != 0) fail("spill truncate");
+        }
+        return job;
+    }
+};
+FileSpillStore spillStore;
+
+// Allocate a job (affinity = pool index, or -1 to let the routing policy choose) in
+// partitions first..last (indices); see BestFitAllocator::allocate
+Placement allocateJob(Job job, int affinity = -1, int first = 0, int last = INT_MAX) {
+    return bestFit.allocate(job, affinity, first, last);
+}
+
+// Add a pool that a command or trace creates without naming it: "pool<N>" for the N-th pool,
+// with a suffix if --pool already took that name (names label the metrics, so they must
+// stay unique). Returns its index.
+int addNumberedPool() {
+    string name = "pool" + to_string(pools.size() + 1);
+    string unique = name;
+    for (int k = 2; bestFit.findPool(unique) != -1; k++) unique = name + "_" + to_string(k);
+    return bestFit.addPool(unique);
+}
+
+// Deallocate a job from whichever pool holds it; {-1, -1} if no partition holds the job
+Placement deallocateJob(int jobNumber) {
+    Placement freed = bestFit.deallocate(jobNumber);
+    if (freed.pool == -1 && !quietMode) cout << "\nJob not found.\n";
+    return freed;
+}
+
+// Deallocate the job a handle refers to; returns its job number, or -1 if the handle is stale
+// (where it was freed from goes to *freedFrom, if given)
+int deallocateHandle(Placement handle, Placement *freedFrom = nullptr) {
+    int jobNumber = bestFit.deallocateHandle(handle, freedFrom);
+    if (jobNumber == -1 && !quietMode) cout << "\nStale or invalid handle.\n";
+    return jobNumber;
+}
 
-    // Loop through partitions to find the best fit (smallest leftover space)
-    for (int i = 0; i < memory.size(); i++) {
-        if (memory[i].isFree && memory[i].size >= job.jobSize) { // Must be free and large enough
-            int leftover = memory[i].size - job.jobSize; // Calculate leftover space
-            if (leftover < smallestFit) { // Update if this is a better fit
-                smallestFit = leftover;
-                bestIndex = i;
+
+// Metrics export settings (set from the command line, see main)
+string metricsPath;              // File rewritten with Prometheus metrics ("" = disabled)
+int metricsIntervalSeconds = 5;  // Minimum time between two rewrites
+chrono::steady_clock::time_point lastMetricsWrite;
+
+// Write all counters and gauges in Prometheus text exposition format, one sample per pool
+// (labelled pool="<name>"). Everything comes from the running totals and histograms, so the
+// cost does not grow with the table size.
+void writeMetrics(ostream &out) {
+    // value(pool), or value(pool, poolIndex) for the figures the allocator computes per index
+    auto metric = [&](const char *name, const char *type, const char *help, auto value) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " " << type << "\n";
+        for (int p = 0; p < (int)pools.size(); p++) {
+            double sample;
+            if constexpr (is_invocable_v<decltype(value), const MemoryPool &>) sample = (double)value(pools[p]);
+            else sample = (double)value(pools[p], p);
+            out << name << "{pool=\"" << pools[p].name << "\"} " << sample << "\n";
+        }
+    };
+
+    out << setprecision(10);
+    metric("bestfit_allocations_total", "counter",
+           "Jobs assigned to a partition, directly or from the waiting queue.",
+           [](const MemoryPool &p) { return p.jobsPlaced; });
+    metric("bestfit_queued_total", "counter",
+           "Jobs that found no free partition and were added to the waiting queue.",
+           [](const MemoryPool &p) { return p.jobsQueued; });
+    metric("bestfit_rejected_total", "counter",
+           "Jobs larger than every partition of the pool, rejected without queueing.",
+           [](const MemoryPool &p) { return p.jobsRejected; });
+    metric("bestfit_queue_full_total", "counter",
+           "Jobs turned away because the waiting queue was full.",
+           [](const MemoryPool &p) { return p.jobsQueueFull; });
+    metric("bestfit_dropped_total", "counter",
+           "Waiting jobs dropped to make room for newer ones.",
+           [](const MemoryPool &p) { return p.jobsDropped; });
+    metric("bestfit_spilled_total", "counter",
+           "Jobs that overflowed the waiting queue into the spill file.",
+           [](const MemoryPool &p) { return p.jobsSpilled; });
+    metric("bestfit_deallocations_total", "counter", "Jobs deallocated from their partition.",
+           [](const MemoryPool &p) { return p.jobsDeallocated; });
+    metric("bestfit_promoted_total", "counter", "Running jobs moved to a faster memory tier.",
+           [](const MemoryPool &p) { return p.jobsPromoted; });
+    metric("bestfit_waiting_queue_depth", "gauge", "Jobs currently waiting for a partition.",
+           [](const MemoryPool &p) { return p.waitingQueue.size() + p.reservations.size(); });
+    metric("bestfit_spilled_jobs", "gauge", "Jobs currently waiting in the spill file.",
+           [](const MemoryPool &p) { return p.spilledJobs; });
+    metric("bestfit_queue_pressure", "gauge",
+           "Waiting jobs (spilled included) over the queue capacity; 0 when unbounded.",
+           [](const MemoryPool &, int p) { return bestFit.queuePressure(p); });
+    metric("bestfit_partitions", "gauge", "Partitions in the memory pool.",
+           [](const MemoryPool &p) { return p.memory.size(); });
+    metric("bestfit_free_partitions", "gauge", "Partitions currently free.",
+           [](const MemoryPool &p) { return p.freePartitions; });
+    metric("bestfit_internal_fragmentation", "gauge",
+           "Sum of internal fragmentation over used partitions.",
+           [](const MemoryPool &p) { return p.totalInternalFragment; });
+    metric("bestfit_memory_utilization_percent", "gauge",
+           "Average of jobSize / size over all partitions, in percent.",
+           [](const MemoryPool &p) { return p.memory.empty() ? 0.0 : p.utilizationSum / p.memory.size(); });
+    metric("bestfit_access_cost", "gauge",
+           "Estimated access cost per unit of job memory, weighted by memory tier cost.",
+           [](const MemoryPool &, int p) { return bestFit.averageAccessCost(p); });
+
+    // One sample per memory tier of each pool (labelled pool="<name>",tier="<n>")
+    auto tierMetric = [&](const char *name, const char *help, auto value) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " gauge\n";
+        for (auto &pool : pools)
+            for (int t = 0; t < (int)pool.tierUsage.size(); t++)
+                if (pool.tierUsage[t].partitions > 0)
+                    out << name << "{pool=\"" << pool.name << "\",tier=\"" << t << "\"} "
+                        << (double)value(pool.tierUsage[t]) << "\n";
+    };
+    tierMetric("bestfit_tier_partitions", "Partitions in the memory tier.",
+               [](const TierUsage &u) { return u.partitions; });
+    tierMetric("bestfit_tier_used_partitions", "Partitions of the memory tier in use.",
+               [](const TierUsage &u) { return u.used; });
+    tierMetric("bestfit_tier_utilization_ratio", "Job memory over the capacity of the memory tier.",
+               [](const TierUsage &u) { return u.capacity == 0 ? 0.0 : (double)u.jobMemory / u.capacity; });
+
+    // Latency histograms use fixed bounds in seconds, derived from the HDR buckets
+    static const uint64_t boundsNs[] = {250, 500, 1000, 2500, 5000, 10000, 25000,
+                                        50000, 100000, 250000, 1000000, 10000000};
+    out << "# HELP bestfit_operation_latency_seconds Time spent in allocator operations.\n"
+        << "# TYPE bestfit_operation_latency_seconds histogram\n";
+    auto histogram = [&](const char *op, const LatencyHistogram &h) {
+        for (uint64_t bound : boundsNs)
+            out << "bestfit_operation_latency_seconds_bucket{op=\"" << op << "\",le=\""
+                << bound / 1e9 << "\"} " << h.countAtOrBelow(bound) << "\n";
+        out << "bestfit_operation_latency_seconds_bucket{op=\"" << op << "\",le=\"+Inf\"} " << h.total << "\n"
+            << "bestfit_operation_latency_seconds_sum{op=\"" << op << "\"} " << h.sum / 1e9 << "\n"
+            << "bestfit_operation_latency_seconds_count{op=\"" << op << "\"} " << h.total << "\n";
+    };
+    histogram("allocate", bestFit.allocateLatency());
+    histogram("deallocate", bestFit.deallocateLatency());
+    histogram("retry_waiting", bestFit.retryLatency());
+}
+
+// Rewrite the metrics file. The text goes to a temporary file that is then renamed over
+// the target, so a scraper never reads a half-written file.
+void writeMetricsFile() {
+    string tmpPath = metricsPath + ".tmp";
+    ofstream out(tmpPath);
+    if (!out) {
+        cout << "\nCould not write metrics file " << tmpPath << ".\n";
+        return;
+    }
+    writeMetrics(out);
+    out.close();
+    if (rename(tmpPath.c_str(), metricsPath.c_str()) != 0)
+        cout << "\nCould not replace metrics file " << metricsPath << ".\n";
+    lastMetricsWrite = chrono::steady_clock::now();
+}
+
+// Rewrite the metrics file if it is enabled and the interval has passed
+void maybeWriteMetrics() {
+    if (metricsPath.empty()) return;
+    if (chrono::steady_clock::now() - lastMetricsWrite >= chrono::seconds(metricsIntervalSeconds))
+        writeMetricsFile();
+}
+
+// One parsed line of the command protocol
+struct Command {
+    char op;           // Upper-case command letter
+    int argCount;      // Number of integer arguments given (at most 5)
+    long long args[5]; // The arguments
+};
+
+// Buffered reader for the command protocol. Input is pulled with read() in 64 KiB blocks
+// and parsed in place with a hand-written integer parser, so a command costs a few dozen
+// instructions instead of several istream extractions. Lines look like "A 512 2";
+// blank lines and lines starting with '#' are skipped.
+struct CommandReader {
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+    enum Result { COMMAND_OK, COMMAND_BAD, COMMAND_END };
+
+    int fd;
+    char buffer[BUFFER_SIZE];
+    size_t pos = 0, end = 0;
+    bool atEof = false;
+    long long lineNumber = 0; // Line of the command last returned (for error messages)
+
+    explicit CommandReader(int inputFd) : fd(inputFd) {}
+
+    // Next input character without consuming it, or -1 at end of input
+    int peek() {
+        if (pos == end && !refill()) return -1;
+        return (unsigned char)buffer[pos];
+    }
+
+    bool refill() {
+        if (atEof) return false;
+        ssize_t n;
+        do n = read(fd, buffer, BUFFER_SIZE); while (n < 0 && errno == EINTR);
+        if (n <= 0) { atEof = true; return false; }
+        pos = 0;
+        end = n;
+        return true;
+    }
+
+    void skipBlanks() {
+        int c;
+        while ((c = peek()) == ' ' || c == '\t' || c == '\r') pos++;
+    }
+
+    // Consume the rest of the current line including its newline
+    void skipLine() {
+        int c;
+        while ((c = peek()) != -1) {
+            pos++;
+            if (c == '\n') break;
+        }
+    }
+
+    // Parse an optionally signed decimal integer; fails on no digits or overflow
+    bool parseInt(long long &value) {
+        bool negative = false;
+        if (peek() == '-') { negative = true; pos++; }
+        int c = peek();
+        if (c < '0' || c > '9') return false;
+        long long v = 0;
+        while ((c = peek()) >= '0' && c <= '9') {
+            if (v > (LLONG_MAX - (c - '0')) / 10) return false;
+            v = v * 10 + (c - '0');
+            pos++;
+        }
+        value = negative ? -v : v;
+        return true;
+    }
+
+    // Read the next command. Malformed lines are consumed and reported as COMMAND_BAD.
+    Result next(Command &cmd) {
+        while (true) {
+            skipBlanks();
+            int c = peek();
+            if (c == -1) return COMMAND_END;
+            lineNumber++;
+            if (c == '\n') { pos++; continue; }            // Blank line
+            if (c == '#') { skipLine(); continue; }         // Comment
+
+            cmd.op = (char)toupper(c);
+            cmd.argCount = 0;
+            pos++;
+            while (true) {
+                skipBlanks();
+                c = peek();
+                if (c == '\n' || c == -1) break;
+                if (cmd.argCount == 5 || !parseInt(cmd.args[cmd.argCount])) {
+                    skipLine();
+                    return COMMAND_BAD;
+                }
+                cmd.argCount++;
             }
+            if (c == '\n') pos++;
+            return COMMAND_OK;
+        }
+    }
+};
+
+// State carried from one command to the next
+struct CommandSession {
+    int jobCounter = 1;       // Number of the next job
+    bool jobsStarted = false; // Partitions of existing pools can only be added before the first job command
+    size_t fixedPools = 0;    // Pools that existed at the first job command
+    long long executed = 0;
+
+    void startJobs() {
+        if (!jobsStarted) fixedPools = pools.size();
+        jobsStarted = true;
+    }
+};
+
+// Execute one command of the protocol (see runCommands). A bad command is reported
+// through bad(reason) and skipped. Returns false on "Q".
+template <class Report>
+bool executeCommand(const Command &cmd, CommandSession &session, Report bad) {
+    if (cmd.op == 'P') {
+        long long pool = (cmd.argCount >= 2 ? cmd.args[1] : 1);
+        long long tier = (cmd.argCount == 3 ? cmd.args[2] : 0);
+        if (cmd.argCount < 1 || cmd.argCount > 3 || cmd.args[0] <= 0 || cmd.args[0] > INT_MAX ||
+            pool < 1 || pool > (long long)pools.size() + 1 || tier < 0 || tier >= MAX_TIERS)
+            bad("usage: P <size> [pool [tier]], size > 0, tier 0-7");
+        else if (session.jobsStarted && pool <= (long long)session.fixedPools)
+            bad("partitions can only be added to new pools after the first job command");
+        else {
+            if (pool > (long long)pools.size()) addNumberedPool();
+            bestFit.addPartition(pool - 1, (int)cmd.args[0], (int)tier);
+        }
+    } else if (cmd.op == 'N') {
+        if (cmd.argCount != 0 || pools.size() >= UINT16_MAX) bad("usage: N");
+        else addNumberedPool();
+    } else if (cmd.op == 'A') {
+        if (cmd.argCount < 1 || cmd.argCount == 4 || cmd.args[0] <= 0 || cmd.args[0] > INT_MAX ||
+            (cmd.argCount >= 2 && (cmd.args[1] < 0 || cmd.args[1] > INT_MAX)) ||
+            (cmd.argCount >= 3 && (cmd.args[2] < 0 || cmd.args[2] > (long long)pools.size())) ||
+            (cmd.argCount == 5 && (cmd.args[3] < 1 || cmd.args[4] < cmd.args[3] || cmd.args[4] > INT_MAX))) {
+            bad("usage: A <size> [priority [pool [first last]]], size > 0, priority >= 0, pool 0 (any) or 1..pools, "
+                "1 <= first <= last");
+            return true;
+        }
+        session.startJobs();
+        allocateJob({session.jobCounter++, (int)cmd.args[0], cmd.argCount >= 2 ? (int)cmd.args[1] : 0, 0},
+                    cmd.argCount >= 3 ? (int)cmd.args[2] - 1 : -1,
+                    cmd.argCount == 5 ? (int)cmd.args[3] - 1 : 0, cmd.argCount == 5 ? (int)cmd.args[4] - 1 : INT_MAX);
+    } else if (cmd.op == 'D') {
+        if (cmd.argCount != 1 || cmd.args[0] > INT_MAX || cmd.args[0] < INT_MIN) { bad("usage: D <job>"); return true; }
+        session.startJobs();
+        deallocateJob((int)cmd.args[0]);
+    } else if (cmd.op == 'F') {
+        if (cmd.argCount < 2 || cmd.argCount > 3 || cmd.args[0] < 1 || cmd.args[0] > INT_MAX || cmd.args[1] < 0 ||
+            cmd.args[1] > UINT32_MAX || (cmd.argCount == 3 && (cmd.args[2] < 1 || cmd.args[2] > (long long)pools.size()))) {
+            bad("usage: F <partition> <generation> [pool]");
+            return true;
         }
+        session.startJobs();
+        deallocateHandle({cmd.argCount == 3 ? (int)cmd.args[2] - 1 : 0, (int)cmd.args[0] - 1, (uint32_t)cmd.args[1]});
+    } else if (cmd.op == 'S') {
+        bestFit.flushRetries();
+        showStatus();
+    } else if (cmd.op == 'B') {
+        if (cmd.argCount != 1 || cmd.args[0] < 0 || cmd.args[0] > 2) bad("usage: B <0|1|2>");
+        else bestFit.setBackfillMode((BackfillMode)cmd.args[0]);
+    } else if (cmd.op == 'R') {
+        if (cmd.argCount != 1 || cmd.args[0] < 0 || cmd.args[0] > 2) bad("usage: R <0|1|2>");
+        else bestFit.setRoutingPolicy((RoutingPolicy)cmd.args[0]);
+    } else if (cmd.op == 'Q') {
+        return false;
+    } else {
+        bad("unknown command");
     }
 
-    // If no suitable partition found, add job to waiting queue
-    if (bestIndex == -1) {
-        cout << "\nNo available partition for Job " << job.jobNumber
-             << " → Added to waiting queue.\n";
-        waitingQueue.push_back(job);
+    // Checking the clock is cheap but not free, so only look every 1024 commands
+    if ((++session.executed & 1023) == 0) maybeWriteMetrics();
+    return true;
+}
+
+// Run the command protocol from a file descriptor until end of input or "Q".
+//   P <size> [pool [tier]]      add a partition to pool 1, 2, ... (default 1; the next unused
+//                               number creates a new pool; after the first job command only
+//                               pools created after it take partitions) in memory tier 0-7
+//                               (default 0, the fastest)
+//   N                           add a pool with no partitions (numbered like a new pool of P)
+//   A <size> [priority [pool [first last]]]  add a job (numbered 1, 2, 3... in order of A
+//                               commands); pool 0 or omitted lets the routing policy choose;
+//                               first..last limits its placement to those partition IDs
+//   D <job>                     deallocate a job
+//   F <partition> <generation> [pool]  deallocate by handle: the partition ID and its generation
+//                               (0 for a partition's first job, +1 after each free), pool default 1
+//   S                           show status
+//   B <mode>                    set backfill mode (0 = Off, 1 = EASY, 2 = Conservative)
+//   R <policy>                  set routing policy (0 = Affinity, 1 = Least Utilized, 2 = Best Fit)
+//   Q                           quit
+// Bad commands are reported on stderr with their line number and skipped.
+void runCommands(int fd) {
+    CommandReader reader(fd);
+    Command cmd;
+    CommandSession session;
+
+    auto bad = [&](const char *why) {
+        cerr << "Line " << reader.lineNumber << ": " << why << "\n";
+    };
+
+    while (true) {
+        CommandReader::Result result = reader.next(cmd);
+        if (result == CommandReader::COMMAND_END) break;
+        if (result == CommandReader::COMMAND_BAD) { bad("malformed command"); continue; }
+        if (!executeCommand(cmd, session, bad)) break;
+    }
+    bestFit.flushRetries();
+}
+
+// Binary protocol of the allocator server. Requests and responses are fixed-size records
+// in host byte order (the socket never leaves the machine). A client may send any number of
+// requests before reading responses; they are answered in order.
+// A placed job's handle is (pool, partitionId, generation) from its ALLOCATED response;
+// OP_FREE_HANDLE frees it without the search OP_DEALLOCATE needs (also after the job was
+// promoted to a faster tier; the response then names the partition it was freed from).
+enum WireOp : uint16_t {
+    OP_ALLOCATE = 1,   // arg0 = job size, arg1 = priority, pool = affinity (0 = any)
+    OP_DEALLOCATE = 2, // arg0 = job number
+    OP_STATUS = 3,     // no arguments
+    OP_FREE_HANDLE = 4 // pool, arg0 = partition ID, arg1 = generation
+};
+
+enum WireStatus : uint16_t {
+    RESP_ALLOCATED = 0,   // jobNumber placed in partitionId of pool, value = generation
+    RESP_QUEUED = 1,      // jobNumber added to the waiting queue of pool, value = queue pressure in percent
+    RESP_DEALLOCATED = 2, // jobNumber freed from partitionId of pool
+    RESP_NOT_FOUND = 3,   // No partition holds jobNumber, or the handle is stale
+    RESP_STATUS = 4,      // partitionId = partitions, jobNumber = free partitions, value = queue depth (all pools)
+    RESP_BAD_REQUEST = 5, // Unknown op or invalid arguments
+    RESP_REJECTED = 6,    // jobNumber is larger than every partition of pool; it was not queued
+    RESP_QUEUE_FULL = 7,  // jobNumber had to wait but the waiting queue of pool is full; it was not queued
+    RESP_DROPPED = 8      // jobNumber was queued, then dropped from the full waiting queue of pool; it will never be placed
+};
+
+// Pools are numbered from 1 on the wire, so 0 can mean "no pool"
+struct WireRequest {
+    uint16_t op;
+    uint16_t pool;
+    int32_t arg0;
+    int32_t arg1;
+};
+
+struct WireResponse {
+    uint16_t status;
+    uint16_t pool;
+    int32_t jobNumber;
+    int32_t partitionId;
+    int32_t value;
+};
+
+static_assert(sizeof(WireRequest) == 12 && sizeof(WireResponse) == 16, "wire records must be packed");
+
+int serverJobCounter = 1;  // Job numbers handed out by the server
+unordered_map<int, int> droppedJobs; // Pool of each queued job dropped to make room, until its owner frees it
+volatile sig_atomic_t stopRequested = 0; // Set by SIGINT/SIGTERM to shut the server down
+
+// Execute one request against the allocator
+WireResponse serveRequest(const WireRequest &req) {
+    WireResponse resp = {RESP_BAD_REQUEST, 0, 0, 0, 0};
+    if (req.op == OP_ALLOCATE) {
+        if (req.arg0 <= 0 || req.arg1 < 0 || req.pool > pools.size()) return resp;
+        Job job = {serverJobCounter++, req.arg0, req.arg1, 0};
+        Placement placement = allocateJob(job, (int)req.pool - 1);
+        resp.jobNumber = job.jobNumber;
+        resp.pool = (uint16_t)(placement.pool + 1);
+        if (placement.index == -1) {
+            resp.status = RESP_QUEUED;
+            resp.value = (int32_t)(bestFit.queuePressure(placement.pool) * 100);
+        }
+        else if (placement.index == INDEX_REJECTED) resp.status = RESP_REJECTED;
+        else if (placement.index == INDEX_QUEUE_FULL) resp.status = RESP_QUEUE_FULL;
+        else {
+            resp.status = RESP_ALLOCATED;
+            resp.partitionId = placement.index + 1;
+            resp.value = (int32_t)placement.generation;
+        }
+    } else if (req.op == OP_DEALLOCATE || req.op == OP_FREE_HANDLE) {
+        Placement placement = {-1, -1};
+        if (req.op == OP_DEALLOCATE) {
+            resp.jobNumber = req.arg0;
+            auto dropped = droppedJobs.find(req.arg0);
+            if (dropped != droppedJobs.end()) {
+                // Answered once; the job number is never handed out again
+                resp.status = RESP_DROPPED;
+                resp.pool = (uint16_t)(dropped->second + 1);
+                droppedJobs.erase(dropped);
+                return resp;
+            }
+            placement = deallocateJob(req.arg0);
+        } else {
+            // Checked like the F command; arg0 - 1 must not overflow
+            if (req.arg0 < 1 || req.pool < 1 || req.pool > pools.size()) return resp;
+            resp.jobNumber = deallocateHandle({(int)req.pool - 1, req.arg0 - 1, (uint32_t)req.arg1}, &placement);
+        }
+        if (placement.index == -1) resp.status = RESP_NOT_FOUND;
+        else {
+            resp.status = RESP_DEALLOCATED;
+            resp.pool = (uint16_t)(placement.pool + 1);
+            resp.partitionId = placement.index + 1;
+        }
+    } else if (req.op == OP_STATUS) {
+        bestFit.flushRetries();
+        resp.status = RESP_STATUS;
+        resp.partitionId = (int32_t)bestFit.totalPartitions();
+        for (auto &pool : pools) {
+            resp.jobNumber += pool.freePartitions;
+            resp.value += (int32_t)(pool.waitingQueue.size() + pool.reservations.size());
+        }
+    }
+    return resp;
+}
+
+// Write a whole buffer, retrying on short writes and signals
+bool writeAll(int fd, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+void handleStopSignal(int) { stopRequested = 1; }
+
+// Open a Unix domain stream socket bound to (server) or connected to (client) a path
+int openUnixSocket(const string &path, bool listening) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (listening) {
+        unlink(path.c_str()); // Remove a stale socket left by a previous run
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, SOMAXCONN) == 0) return fd;
+    } else {
+        if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+// State of one client connection in the event loop. Requests are parsed straight out of
+// the input buffer and responses appended straight into the output buffer.
+struct Connection {
+    static const size_t INPUT_SIZE = 4096;        // Up to 341 pipelined requests per read
+    static const size_t OUTPUT_LIMIT = 256 * 1024; // Stop reading while this much output is unsent
+
+    int fd;
+    char in[INPUT_SIZE];
+    size_t inUsed = 0;
+    vector<char> out;
+    size_t outSent = 0;     // Bytes of out already written to the socket
+    uint32_t interest = 0;  // epoll events currently registered
+    bool inputClosed = false; // The client shut down its side; closed once the output has drained
+
+    size_t pendingOutput() const { return out.size() - outSent; }
+};
+
+// Execute every complete request in the input buffer as one batch, appending the responses
+// to the output buffer. A trailing partial request stays for the next read.
+void processRequests(Connection &c) {
+    size_t count = c.inUsed / sizeof(WireRequest);
+    if (count == 0) return;
+
+    size_t outStart = c.out.size();
+    c.out.resize(outStart + count * sizeof(WireResponse));
+    for (size_t i = 0; i < count; i++) {
+        WireRequest req;
+        memcpy(&req, c.in + i * sizeof(WireRequest), sizeof(req)); // The buffer may be unaligned
+        WireResponse resp = serveRequest(req);
+        memcpy(c.out.data() + outStart + i * sizeof(WireResponse), &resp, sizeof(resp));
+    }
+
+    size_t used = count * sizeof(WireRequest);
+    memmove(c.in, c.in + used, c.inUsed - used);
+    c.inUsed -= used;
+}
+
+// Write as much pending output as the socket takes. Returns false if the connection failed.
+bool flushOutput(Connection &c) {
+    while (c.pendingOutput() > 0) {
+        ssize_t n = write(c.fd, c.out.data() + c.outSent, c.pendingOutput());
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) return false;
+        c.outSent += n;
+    }
+    if (c.outSent == c.out.size()) {
+        c.out.clear();
+        c.outSent = 0;
+    }
+    return true;
+}
+
+// Register interest in reading unless the client is not draining its responses
+// (backpressure) or has shut down its side, and in writing while output is pending
+void updateInterest(int epollFd, Connection &c) {
+    uint32_t wanted = (!c.inputClosed && c.pendingOutput() < Connection::OUTPUT_LIMIT ? (uint32_t)EPOLLIN : 0u) |
+                      (c.pendingOutput() > 0 ? (uint32_t)EPOLLOUT : 0u);
+    if (wanted == c.interest) return;
+    epoll_event ev = {};
+    ev.events = wanted;
+    ev.data.ptr = &c;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &ev);
+    c.interest = wanted;
+}
+
+// Raise the open file limit to the hard limit so thousands of clients can connect
+void raiseFileLimit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Serve allocation requests on a Unix domain socket until SIGINT or SIGTERM.
+// A single thread runs an epoll loop over non-blocking sockets, so the allocator needs no
+// locking and thousands of connections cost only their buffers.
+void runServer(const string &path) {
+    raiseFileLimit();
+    int listenFd = openUnixSocket(path, true);
+    if (listenFd < 0) {
+        cout << "Could not listen on " << path << ": " << strerror(errno) << "\n";
         return;
     }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+
+    // No SA_RESTART, so a stop signal interrupts epoll_wait()
+    struct sigaction action = {};
+    action.sa_handler = handleStopSignal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN); // A vanished client must not kill the server
+    bestFit.addObserver([](const AllocatorEvent &e) {
+        if (e.type == EVENT_DROP) droppedJobs[e.jobNumber] = e.placement.pool;
+    });
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event listenEvent = {};
+    listenEvent.events = EPOLLIN;
+    listenEvent.data.ptr = nullptr; // nullptr marks the listening socket
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+
+    auto closeConnection = [&](Connection *c) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, nullptr);
+        close(c->fd);
+        delete c;
+    };
+
+    cout << "Serving " << bestFit.totalPartitions() << " partitions in " << pools.size() << " pool(s) on " << path << "\n";
+    cout.flush();
+
+    const int MAX_EVENTS = 256;
+    epoll_event events[MAX_EVENTS];
+    long long connections = 0;
+    while (!stopRequested) {
+        // Wake up at least once a second, and in time to close a coalescing window
+        long long windowNs = bestFit.retryWindowRemainingNs();
+        int timeoutMs = (windowNs < 0 ? 1000 : (int)min(1000LL, (windowNs + 999999) / 1000000));
+        int ready = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+        for (int e = 0; e < ready; e++) {
+            Connection *c = (Connection *)events[e].data.ptr;
 
-    // Allocate the job to the best partition
-    memory[bestIndex].isFree = false; // Mark as used
-    memory[bestIndex].jobNumber = job.jobNumber;
-    memory[bestIndex].jobSize = job.jobSize;
-    memory[bestIndex].internalFragment = memory[bestIndex].size - job.jobSize; // Calculate waste
+            if (c == nullptr) { // New clients: accept all that are waiting
+                int fd;
+                while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    Connection *conn = new Connection();
+                    conn->fd = fd;
+                    conn->interest = EPOLLIN;
+                    epoll_event ev = {};
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = conn;
+                    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+                    connections++;
+                }
+                continue;
+            }
+
+            bool alive = !(events[e].events & EPOLLERR);
+            if (alive && (events[e].events & EPOLLOUT)) alive = flushOutput(*c);
+
+            // Read everything available, executing complete requests as each read lands,
+            // until the socket is drained or the client falls behind on its responses
+            while (alive && !c->inputClosed && (events[e].events & (EPOLLIN | EPOLLHUP)) &&
+                   c->pendingOutput() < Connection::OUTPUT_LIMIT) {
+                ssize_t n = read(c->fd, c->in + c->inUsed, Connection::INPUT_SIZE - c->inUsed);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                if (n < 0) { alive = false; break; }
+                if (n == 0) { c->inputClosed = true; break; } // No more requests, but answer the ones read
+                c->inUsed += n;
+                processRequests(*c);
+            }
+            if (alive) processRequests(*c); // Requests held back by earlier backpressure
+            if (alive) alive = flushOutput(*c);
+            if (alive && c->inputClosed && c->pendingOutput() == 0) alive = false; // Everything answered
+
+            if (alive) updateInterest(epollFd, *c);
+            else closeConnection(c);
+        }
+        bestFit.flushRetriesIfExpired(); // A burst of frees followed by silence still gets its pass
+        maybeWriteMetrics();
+    }
 
-    cout << "\nJob " << job.jobNumber << " allocated to Partition "
-         << memory[bestIndex].id << " (Best Fit).\n";
+    close(epollFd);
+    close(listenFd);
+    unlink(path.c_str());
+    cout << "Server stopped after " << connections << " connection(s).\n";
 }
 
-// Function to try allocating jobs from the waiting queue (called after deallocation)
-void tryAllocateWaiting() {
-    if (waitingQueue.empty()) return; // Nothing to do if queue is empty
+// Binary command trace: the command protocol as fixed-width records, for replays too large
+// to parse as text. The file is in host byte order and every part is 4-byte aligned:
+//   TraceFileHeader
+//   WireRequest records[records]  one per command, run in order (the server's request layout;
+//                                 B, R and late or tiered P commands use the ops below)
+//   uint32 pools, uint32 partitions[pools], int32 sizes[]  the partition layout: the untiered
+//                                 P and the N commands the trace starts with, added to pools
+//                                 1, 2, ... before the first record (a pool may have none)
+// The layout follows the records so a conversion can stream the records in a single pass.
+enum TraceOp : uint16_t {
+    OP_BACKFILL = 5, // arg0 = backfill mode
+    OP_ROUTING = 6,  // arg0 = routing policy
+    OP_PARTITION = 7, // pool, arg0 = partition size, arg1 = tier (a P command with a tier or
+                      // after any other command, and every P command after those)
+    OP_POOL = 8       // no arguments: a new pool with no partitions (an N command after the layout)
+};
 
-    vector<Job> remaining; // Temporary list for jobs that still can't be allocated
+struct TraceFileHeader {
+    char magic[8];         // TRACE_MAGIC
+    uint32_t recordSize;   // sizeof(WireRequest)
+    uint32_t reserved;
+    uint64_t records;      // Number of records
+    uint64_t layoutOffset; // Byte offset of the partition layout
+};
 
-    // Process each waiting job
-    for (auto &j : waitingQueue) {
-        int bestIndex = -1, small = INT_MAX; // Using INT_MAX instead of magic number 999999
+static_assert(sizeof(TraceFileHeader) == 32, "trace header must be packed");
+const char TRACE_MAGIC[8] = {'B', 'F', 'T', 'R', 'A', 'C', 'E', '1'};
 
-        for (int i = 0; i < memory.size(); i++) {
-            if (memory[i].isFree && memory[i].size >= j.jobSize) {
-                int leftover = memory[i].size - j.jobSize;
-                if (leftover < small) {
-                    small = leftover;
-                    bestIndex = i;
+// Convert a command file ("-" = stdin) to a binary trace. Every command becomes one record
+// except the untiered P and the N commands at the start of the file, which go to the layout; the first
+// other command (or tiered P) closes it, so e.g. an S between P commands still sees only the
+// partitions added before it. Q ends the conversion. Commands whose arguments do
+// not fit a record (e.g. A with a partition range) are reported on stderr and left out;
+// everything else is checked on replay.
+bool convertCommandTrace(const string &inPath, const string &outPath) {
+    int fd = (inPath == "-" ? STDIN_FILENO : open(inPath.c_str(), O_RDONLY));
+    if (fd < 0) {
+        cout << "Could not open command file " << inPath << "\n";
+        return false;
+    }
+    FILE *out = fopen(outPath.c_str(), "wb");
+    if (out == nullptr) {
+        cout << "Could not write trace file " << outPath << "\n";
+        if (fd != STDIN_FILENO) close(fd);
+        return false;
+    }
+
+    TraceFileHeader header = {};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.recordSize = sizeof(WireRequest);
+    fwrite(&header, sizeof(header), 1, out); // Rewritten with the counts at the end
+
+    CommandReader reader(fd);
+    Command cmd;
+    vector<vector<int32_t>> layout; // Partition sizes per pool
+    bool jobsStarted = false;
+    long long knownPools = 1, fixedPools = 0; // Pools so far (the run starts with one); pools at the first job
+    bool layoutClosed = false;                // A record was written, so later P commands must be records too
+    auto bad = [&](const char *why) {
+        cerr << "Line " << reader.lineNumber << ": " << why << "\n";
+    };
+    auto fits = [](long long v) { return v >= INT32_MIN && v <= INT32_MAX; };
+
+    while (true) {
+        CommandReader::Result result = reader.next(cmd);
+        if (result == CommandReader::COMMAND_END) break;
+        if (result == CommandReader::COMMAND_BAD) { bad("malformed command"); continue; }
+        if (cmd.op == 'Q') break;
+
+        const long long *a = cmd.args;
+        if (cmd.op == 'P') {
+            // Checked as if the run started from the single default pool
+            long long pool = (cmd.argCount >= 2 ? a[1] : 1);
+            long long tier = (cmd.argCount == 3 ? a[2] : 0);
+            if (cmd.argCount < 1 || cmd.argCount > 3 || a[0] <= 0 || a[0] > INT_MAX || pool < 1 || pool > knownPools + 1 ||
+                pool > UINT16_MAX || tier < 0 || tier >= MAX_TIERS) bad("usage: P <size> [pool [tier]], size > 0, tier 0-7");
+            else if (jobsStarted && pool <= fixedPools)
+                bad("partitions can only be added to new pools after the first job command");
+            else {
+                knownPools = max(knownPools, pool);
+                if (!layoutClosed && tier == 0) {
+                    if ((long long)layout.size() < pool) layout.resize(pool);
+                    layout[pool - 1].push_back((int32_t)a[0]);
+                    continue;
                 }
+                layoutClosed = true;
+                WireRequest record = {OP_PARTITION, (uint16_t)pool, (int32_t)a[0], (int32_t)tier};
+                fwrite(&record, sizeof(record), 1, out);
+                header.records++;
+            }
+            continue;
+        }
+        if (cmd.op == 'N') {
+            if (cmd.argCount != 0 || knownPools >= UINT16_MAX) {
+                bad("usage: N");
+                continue;
+            }
+            knownPools++;
+            if (!layoutClosed) {
+                layout.resize(knownPools);
+                continue;
             }
+            WireRequest record = {OP_POOL, 0, 0, 0};
+            fwrite(&record, sizeof(record), 1, out);
+            header.records++;
+            continue;
         }
 
-        // If allocation succeeds, update partition and print message
-        if (bestIndex != -1) {
-            memory[bestIndex].isFree = false;
-            memory[bestIndex].jobNumber = j.jobNumber;
-            memory[bestIndex].jobSize = j.jobSize;
-            memory[bestIndex].internalFragment = memory[bestIndex].size - j.jobSize;
+        WireRequest record = {0, 0, 0, 0};
+        if (cmd.op == 'A' && cmd.argCount >= 1 && cmd.argCount <= 3 && fits(a[0]) && (cmd.argCount < 2 || fits(a[1])) &&
+            (cmd.argCount < 3 || (a[2] >= 0 && a[2] <= UINT16_MAX)))
+            record = {OP_ALLOCATE, (uint16_t)(cmd.argCount == 3 ? a[2] : 0), (int32_t)a[0],
+                      (int32_t)(cmd.argCount >= 2 ? a[1] : 0)};
+        else if (cmd.op == 'D' && cmd.argCount == 1 && fits(a[0]))
+            record = {OP_DEALLOCATE, 0, (int32_t)a[0], 0};
+        else if (cmd.op == 'F' && cmd.argCount >= 2 && cmd.argCount <= 3 && fits(a[0]) && a[1] >= 0 && a[1] <= UINT32_MAX &&
+                 (cmd.argCount < 3 || (a[2] >= 0 && a[2] <= UINT16_MAX)))
+            record = {OP_FREE_HANDLE, (uint16_t)(cmd.argCount == 3 ? a[2] : 1), (int32_t)a[0],
+                      (int32_t)(uint32_t)a[1]}; // The generation keeps its 32 bits
+        else if (cmd.op == 'S' && cmd.argCount == 0)
+            record = {OP_STATUS, 0, 0, 0};
+        else if ((cmd.op == 'B' || cmd.op == 'R') && cmd.argCount == 1 && fits(a[0]))
+            record = {(uint16_t)(cmd.op == 'B' ? OP_BACKFILL : OP_ROUTING), 0, (int32_t)a[0], 0};
+        else {
+            bad(strchr("ADFSBR", cmd.op) ? "arguments do not fit a trace record" : "unknown command");
+            continue;
+        }
+        if (record.op != OP_STATUS && record.op != OP_BACKFILL && record.op != OP_ROUTING && !jobsStarted) {
+            jobsStarted = true;
+            fixedPools = knownPools;
+        }
+        layoutClosed = true;
+        fwrite(&record, sizeof(record), 1, out);
+        header.records++;
+    }
+    if (fd != STDIN_FILENO) close(fd);
 
-            cout << "\nWaiting Job " << j.jobNumber
-                 << " allocated to Partition " << memory[bestIndex].id << ".\n";
-        } else {
-            // If still no fit, keep in remaining list
-            remaining.push_back(j);
+    // The layout, then the header with the final counts
+    header.layoutOffset = sizeof(header) + header.records * sizeof(WireRequest);
+    uint32_t poolCount = (uint32_t)layout.size();
+    long long partitions = 0;
+    fwrite(&poolCount, sizeof(poolCount), 1, out);
+    for (auto &sizes : layout) {
+        uint32_t count = (uint32_t)sizes.size();
+        fwrite(&count, sizeof(count), 1, out);
+        partitions += count;
+    }
+    for (auto &sizes : layout) fwrite(sizes.data(), sizeof(int32_t), sizes.size(), out);
+    bool ok = fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok) {
+        cout << "Could not write trace file " << outPath << "\n";
+        return false;
+    }
+    cout << "Converted " << header.records << " command(s) and " << partitions << " partition(s) in "
+         << poolCount << " pool(s) to " << outPath << "\n";
+    return true;
+}
+
+// Replay a binary trace. The file is mapped read-only and its records are run where they
+// lie, with no copy and no parsing; the kernel reads ahead because access is sequential.
+// Records are checked like commands and bad ones are reported by record number.
+// Returns false if the file cannot be mapped or is not a valid trace.
+bool replayTrace(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cout << "Could not open trace file " << path << "\n";
+        return false;
+    }
+    struct stat st;
+    size_t length = (fstat(fd, &st) == 0 ? (size_t)st.st_size : 0);
+    void *base = (length >= sizeof(TraceFileHeader) ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+    close(fd); // The mapping keeps the file open
+    if (base == MAP_FAILED) {
+        cout << "Not a valid trace file: " << path << "\n";
+        return false;
+    }
+    madvise(base, length, MADV_SEQUENTIAL);
+
+    // Check that every part lies inside the file before touching it
+    const char *bytes = (const char *)base;
+    const TraceFileHeader *header = (const TraceFileHeader *)bytes;
+    const uint32_t *counts = nullptr;
+    uint64_t partitions = 0;
+    bool valid = memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0 &&
+                 header->recordSize == sizeof(WireRequest) &&
+                 header->records <= (length - sizeof(TraceFileHeader)) / sizeof(WireRequest) &&
+                 header->layoutOffset == sizeof(TraceFileHeader) + header->records * sizeof(WireRequest) &&
+                 header->layoutOffset + sizeof(uint32_t) <= length;
+    if (valid) {
+        uint32_t poolCount = *(const uint32_t *)(bytes + header->layoutOffset);
+        counts = (const uint32_t *)(bytes + header->layoutOffset) + 1;
+        valid = poolCount <= UINT16_MAX && header->layoutOffset + (1 + (uint64_t)poolCount) * sizeof(uint32_t) <= length;
+        for (uint32_t p = 0; valid && p < poolCount; p++) partitions += counts[p];
+        valid = valid && header->layoutOffset + (1 + poolCount + partitions) * sizeof(uint32_t) == length;
+    }
+    if (!valid) {
+        cout << "Not a valid trace file: " << path << "\n";
+        munmap(base, length);
+        return false;
+    }
+
+    // The partition layout, added like the P commands it came from
+    uint32_t poolCount = counts[-1];
+    const int32_t *sizes = (const int32_t *)(counts + poolCount);
+    for (uint32_t p = 0; p < poolCount; p++) {
+        while (pools.size() <= p) addNumberedPool();
+        for (uint32_t i = 0; i < counts[p]; i++, sizes++)
+            if (*sizes > 0) bestFit.addPartition(p, *sizes);
+    }
+
+    const WireRequest *records = (const WireRequest *)(bytes + sizeof(TraceFileHeader));
+    CommandSession session;
+    uint64_t n = 0;
+    auto bad = [&](const char *why) {
+        cerr << "Record " << n + 1 << ": " << why << "\n";
+    };
+    for (; n < header->records; n++) {
+        const WireRequest &r = records[n];
+        Command cmd = {'?', 0, {0, 0, 0}};
+        switch (r.op) {
+            case OP_ALLOCATE: cmd = {'A', 3, {r.arg0, r.arg1, r.pool}}; break;
+            case OP_DEALLOCATE: cmd = {'D', 1, {r.arg0, 0, 0}}; break;
+            case OP_FREE_HANDLE: cmd = {'F', 3, {r.arg0, (uint32_t)r.arg1, r.pool}}; break;
+            case OP_STATUS: cmd = {'S', 0, {0, 0, 0}}; break;
+            case OP_BACKFILL: cmd = {'B', 1, {r.arg0, 0, 0}}; break;
+            case OP_ROUTING: cmd = {'R', 1, {r.arg0, 0, 0}}; break;
+            case OP_PARTITION: cmd = {'P', 3, {r.arg0, r.pool, r.arg1}}; break;
+            case OP_POOL: cmd = {'N', 0, {0, 0, 0}}; break;
+        }
+        executeCommand(cmd, session, bad);
+    }
+    bestFit.flushRetries();
+    munmap(base, length);
+    return true;
+}
+
+// Load generator for the server. Each connection keeps up to pipelineDepth requests in
+// flight: it allocates random job sizes and, once it owns 32 jobs, frees the oldest one
+// (by handle if it was placed right away, by job number if it was queued).
+// Latency is measured from send to response; throughput over the whole run.
+void runClient(const string &path, long long totalRequests, int pipelineDepth, int connections, int maxJobSize) {
+    struct ClientResult {
+        LatencyHistogram latency;
+        long long counts[9] = {};
+        bool failed = false;
+    };
+    vector<ClientResult> results(connections);
+    signal(SIGPIPE, SIG_IGN);
+
+    auto worker = [&](int id) {
+        ClientResult &result = results[id];
+        long long quota = totalRequests / connections + (id < totalRequests % connections ? 1 : 0);
+        int fd = openUnixSocket(path, false);
+        if (fd < 0) { result.failed = true; return; }
+
+        uint64_t rng = 0x9E3779B97F4A7C15ULL * (id + 1); // xorshift state, distinct per connection
+        deque<WireRequest> held;                         // Free requests for jobs this connection owns
+        int owned = 0;                                   // Jobs requested and not yet freed
+        vector<chrono::steady_clock::time_point> sentAt(pipelineDepth);
+        vector<WireRequest> batch;
+        vector<char> in(pipelineDepth * sizeof(WireResponse));
+        size_t have = 0;
+        long long sent = 0, received = 0;
+
+        while (received < quota) {
+            // Top up the pipeline
+            batch.clear();
+            auto now = chrono::steady_clock::now();
+            while (sent < quota && sent - received < pipelineDepth) {
+                WireRequest req = {OP_ALLOCATE, 0, 0, 0};
+                if (owned >= 32) {
+                    if (held.empty()) break; // Wait for allocation responses to learn job numbers
+                    req = held.front();
+                    held.pop_front();
+                } else {
+                    rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+                    req.arg0 = 1 + (int)(rng % maxJobSize);
+                    owned++;
+                }
+                sentAt[sent % pipelineDepth] = now;
+                batch.push_back(req);
+                sent++;
+            }
+            if (!batch.empty() && !writeAll(fd, batch.data(), batch.size() * sizeof(WireRequest))) {
+                result.failed = true;
+                break;
+            }
+
+            // Collect whatever responses have arrived
+            ssize_t n = read(fd, in.data() + have, in.size() - have);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { result.failed = true; break; }
+            have += n;
+            now = chrono::steady_clock::now();
+            size_t count = have / sizeof(WireResponse);
+            for (size_t i = 0; i < count; i++) {
+                WireResponse resp;
+                memcpy(&resp, in.data() + i * sizeof(WireResponse), sizeof(resp));
+                result.latency.record(chrono::duration_cast<chrono::nanoseconds>(now - sentAt[received % pipelineDepth]).count());
+                received++;
+                if (resp.status < 9) result.counts[resp.status]++;
+                // Queued jobs are freed too; one that is still waiting answers NOT_FOUND and is
+                // retried later, so no partition is left held once its job gets placed. One
+                // dropped from the queue answers DROPPED and is given up.
+                if (resp.status == RESP_ALLOCATED)
+                    held.push_back({OP_FREE_HANDLE, resp.pool, resp.partitionId, resp.value});
+                else if (resp.status == RESP_QUEUED || (resp.status == RESP_NOT_FOUND && resp.jobNumber > 0))
+                    held.push_back({OP_DEALLOCATE, 0, resp.jobNumber, 0});
+                else if (resp.status == RESP_DEALLOCATED || resp.status == RESP_REJECTED ||
+                         resp.status == RESP_QUEUE_FULL || resp.status == RESP_NOT_FOUND ||
+                         resp.status == RESP_DROPPED)
+                    owned--;
+            }
+            size_t used = count * sizeof(WireResponse);
+            memmove(in.data(), in.data() + used, have - used);
+            have -= used;
         }
+        close(fd);
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int i = 0; i < connections; i++) threads.emplace_back(worker, i);
+    for (auto &t : threads) t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    LatencyHistogram latency;
+    long long counts[9] = {};
+    int failed = 0;
+    for (auto &r : results) {
+        latency.merge(r.latency);
+        for (int i = 0; i < 9; i++) counts[i] += r.counts[i];
+        if (r.failed) failed++;
     }
 
-    // Update waiting queue with remaining jobs
-    waitingQueue = remaining;
+    cout << "Requests: " << latency.total << " over " << connections << " connection(s), pipeline depth "
+         << pipelineDepth << (failed ? " (" + to_string(failed) + " connection(s) failed)" : "") << "\n";
+    cout << "Allocated: " << counts[RESP_ALLOCATED] << "  Queued: " << counts[RESP_QUEUED]
+         << "  Deallocated: " << counts[RESP_DEALLOCATED] << "  Not found: " << counts[RESP_NOT_FOUND]
+         << "  Rejected: " << counts[RESP_REJECTED];
+    if (counts[RESP_QUEUE_FULL] > 0) cout << "  Queue full: " << counts[RESP_QUEUE_FULL];
+    if (counts[RESP_DROPPED] > 0) cout << "  Dropped: " << counts[RESP_DROPPED];
+    cout << "\n";
+    cout << "Throughput: " << fixed << setprecision(0) << latency.total / seconds << " requests/s\n";
+    cout << "Latency (ns)  p50 " << latency.percentile(0.50) << "  p90 " << latency.percentile(0.90)
+         << "  p99 " << latency.percentile(0.99) << "  p99.9 " << latency.percentile(0.999)
+         << "  max " << latency.maxValue << "\n";
 }
 
-// Function to deallocate a job from its partition
-void deallocateJob(int jobNumber) {
-    // Search for the partition with the matching job
-    for (auto &p : memory) {
-        if (!p.isFree && p.jobNumber == jobNumber) { // Must be used and match job
-            cout << "\nJob " << jobNumber << " deallocated from Partition "
-                 << p.id << "\n";
+// Awaitable allocation: co_await allocateAsync(job) yields the pool and partition index. If
+// the job has to wait, the coroutine stays suspended until tryAllocateWaiting places it.
+struct AllocationAwaiter {
+    Job job;
+    int affinity = -1;
+    Placement placement = {-1, -1};
+
+    bool await_ready() {
+        placement = allocateJob(job, affinity);
+        return placement.index != -1; // Placed (or rejected) right away: no suspension
+    }
+    void await_suspend(coroutine_handle<> handle) {
+        allocationWaiters[job.jobNumber] = {handle, &placement};
+    }
+    Placement await_resume() const { return placement; }
+};
+
+AllocationAwaiter allocateAsync(Job job, int affinity = -1) { return AllocationAwaiter{job, affinity}; }
 
-            // Add to deallocated list for tracking
-            deallocatedJobs.push_back({p.jobNumber, p.jobSize});
+// Awaitable that lets the other simulated clients run before this one continues
+struct YieldAwaiter {
+    bool await_ready() const { return false; }
+    void await_suspend(coroutine_handle<> handle) const { readyCoroutines.push_back(handle); }
+    void await_resume() const {}
+};
+
+// Coroutine type of a simulated client: starts suspended and is resumed by the simulation
+// loop, which also destroys its frame once it has finished
+struct SimTask {
+    struct promise_type {
+        SimTask get_return_object() { return SimTask{coroutine_handle<promise_type>::from_promise(*this)}; }
+        suspend_always initial_suspend() noexcept { return {}; }
+        suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+    coroutine_handle<promise_type> handle;
+};
+
+// Results shared by all simulated clients
+struct SimStats {
+    LatencyHistogram waitTicks; // Ticks from request to placement, per job
+    long long jobs = 0;
+    long long rejected = 0;  // Jobs larger than every partition
+    long long queueFull = 0; // Jobs turned away or dropped by a full waiting queue
+    int nextJobNumber = 1;
+};
 
-            // Reset partition to free state
-            p.isFree = true;
-            p.jobNumber = -1;
-            p.jobSize = 0;
-            p.internalFragment = 0;
+// One simulated client: request a random-sized job, hold it while other clients run
+// for a random number of turns, free it, and repeat
+SimTask simulatedClient(int id, int rounds, int maxJobSize, SimStats &stats) {
+    uint64_t rng = 0x9E3779B97F4A7C15ULL * (id + 1); // xorshift state, distinct per client
+    auto random = [&rng](int limit) {
+        rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+        return (int)(rng % limit);
+    };
 
-            // Try to allocate waiting jobs now that space is free
-            tryAllocateWaiting();
-            return; // Exit after deallocating
+    for (int r = 0; r < rounds; r++) {
+        Job job = {stats.nextJobNumber++, 1 + random(maxJobSize), 0, 0};
+        long long requestedAt = bestFit.tick();
+        Placement placement = co_await allocateAsync(job);
+        if (placement.index == INDEX_REJECTED || placement.index == INDEX_QUEUE_FULL) {
+            (placement.index == INDEX_REJECTED ? stats.rejected : stats.queueFull)++;
+            continue;
         }
+        stats.waitTicks.record(bestFit.tick() - requestedAt);
+        stats.jobs++;
+
+        for (int turns = random(8); turns > 0; turns--) co_await YieldAwaiter{};
+        deallocateHandle(placement);
     }
-    // If job not found, print error
-    cout << "\nJob not found.\n";
 }
 
-// Main function: Sets up the simulation and runs the menu loop
-int main() {
+// Run many simulated clients as coroutines on this thread until all are done (or every
+// remaining client waits for a job no partition can hold), then report the results
+void runCoroutineSimulation(int clients, int rounds, int maxJobSize) {
+    SimStats stats;
+    vector<coroutine_handle<SimTask::promise_type>> tasks;
+    for (int i = 0; i < clients; i++) {
+        tasks.push_back(simulatedClient(i, rounds, maxJobSize, stats).handle);
+        readyCoroutines.push_back(tasks.back());
+    }
+
+    auto start = chrono::steady_clock::now();
+    while (true) {
+        if (readyCoroutines.empty()) bestFit.flushRetries(); // Idle: close the coalescing window
+        if (readyCoroutines.empty()) break;
+        coroutine_handle<> next = readyCoroutines.front();
+        readyCoroutines.pop_front();
+        next.resume();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int finished = 0;
+    for (auto &task : tasks) {
+        if (task.done()) finished++;
+        task.destroy(); // Also frees clients still suspended on an impossible job
+    }
+    allocationWaiters.clear();
+
+    cout << "Simulated " << clients << " client(s) x " << rounds << " round(s): "
+         << stats.jobs << " jobs in " << fixed << setprecision(3) << seconds << " s ("
+         << setprecision(0) << stats.jobs / seconds << " jobs/s)\n";
+    if (stats.rejected > 0)
+        cout << stats.rejected << " job(s) rejected as larger than every partition\n";
+    if (stats.queueFull > 0)
+        cout << stats.queueFull << " job(s) turned away or dropped by a full waiting queue\n";
+    if (finished < clients)
+        cout << clients - finished << " client(s) still waiting for jobs that no free partition can hold\n";
+    cout << "Wait (ticks)  p50 " << stats.waitTicks.percentile(0.50) << "  p90 " << stats.waitTicks.percentile(0.90)
+         << "  p99 " << stats.waitTicks.percentile(0.99) << "  max " << stats.waitTicks.maxValue << "\n";
+}
+
+// Add partitions to a pool from a list like "512,1024,100x64,16x4096@1": each item is a size,
+// or COUNTxSIZE, optionally followed by @TIER (memory tier 0-7, default 0)
+bool addPartitionList(int pool, const string &list) {
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        string item = list.substr(pos, comma == string::npos ? string::npos : comma - pos);
+        size_t at = item.find('@');
+        int tier = (at == string::npos ? 0 : atoi(item.substr(at + 1).c_str()));
+        item = item.substr(0, at);
+        size_t x = item.find('x');
+        long long count = (x == string::npos ? 1 : atoll(item.substr(0, x).c_str()));
+        long long size = atoll(item.substr(x == string::npos ? 0 : x + 1).c_str());
+        if (count <= 0 || size <= 0 || size > INT_MAX || tier < 0 || tier >= MAX_TIERS) return false;
+        for (long long i = 0; i < count; i++) bestFit.addPartition(pool, (int)size, tier);
+        if (comma == string::npos) break;
+        pos = comma + 1;
+    }
+    return true;
+}
+
+// Prompt for an integer in [minValue, maxValue], re-prompting on bad or out-of-range input.
+// Returns false at end of input so the menu can exit instead of looping forever.
+bool readInt(const string &prompt, int &value, int minValue, int maxValue, const char *error) {
+    while (true) {
+        cout << prompt;
+        if (cin >> value) {
+            if (value >= minValue && value <= maxValue) return true;
+        } else {
+            if (cin.eof()) return false;
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        }
+        cout << error << "\n";
+    }
+}
+
+// Prompt for a single word (e.g. a file name). Returns false at end of input.
+bool readWord(const string &prompt, string &value) {
+    cout << prompt;
+    return (bool)(cin >> value);
+}
+
+// Session recording (--record): every menu action that changes the allocator is appended to a
+// file in the command protocol, after a "# <microseconds>" comment with the time since the
+// session started. The file replays deterministically with --commands (the timestamps are
+// comments, so it runs at full speed) or converts to a binary trace with --convert-trace.
+// Status views (S) are recorded so the replay prints the same tables; the other views and
+// exports are not. Pools added from the menu replay as pool2, pool3, ...
+ofstream sessionRecord;
+chrono::steady_clock::time_point sessionStart;
+
+// Open the recording; false if the file cannot be written. options are the command line
+// options that change the results (placement, routing, queue limit, ...); the header line
+// shows them as part of the replay command, since the file itself cannot set them.
+bool startRecording(const string &path, const string &options) {
+    sessionRecord.open(path);
+    if (!sessionRecord) return false;
+    sessionStart = chrono::steady_clock::now();
+    sessionRecord << "# Best fit menu session; replay with --commands " << path << options << "\n";
+    return true;
+}
+
+// Append one command with its timestamp. Flushed at once so an interrupted session keeps
+// everything up to its last action.
+void recordAction(const string &command) {
+    if (!sessionRecord.is_open()) return;
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - sessionStart);
+    sessionRecord << "# " << elapsed.count() << "\n" << command << endl;
+}
+
+// Prompt for the memory tier of the i-th partition being entered; only asked for tiered
+// placement (otherwise every partition is in tier 0). Returns false at end of input.
+bool readTier(int i, int &tier) {
+    tier = 0;
+    return bestFit.placementMode() == PLACE_BEST_FIT ||
+           readInt("Enter tier of Partition " + to_string(i + 1) + " (0 = fastest, up to " +
+                   to_string(MAX_TIERS - 1) + "): ", tier, 0, MAX_TIERS - 1, "Invalid tier. Try again.");
+}
+
+// Interactive menu: prompts for the partitions, then loops until Exit or end of input
+void runMenu() {
     int n; // Number of partitions
-    cout << "Enter number of partitions: ";
-    cin >> n;
+    if (!readInt("Enter number of partitions: ", n, 0, INT_MAX, "Invalid number. Try again.")) return;
 
     // Initialize partitions: Prompt for sizes with input validation (must be greater than zero)
+    // They form the first pool; more pools can be added from the menu
+    int defaultPool = bestFit.addPool("default");
     for (int i = 0; i < n; i++) {
-        int s; // Size of partition
-        do {
-            cout << "Enter size of Partition " << i +1 << ": ";
-            cin >> s;
-            if (s <= 0) cout << "Invalid size. Try again.\n";
-        } while (s <= 0); // Loop until valid positive size is entered
-        memory.push_back({i + 1, s, true, -1, 0, 0});
-
+        int s, tier; // Size and memory tier of partition
+        if (!readInt("Enter size of Partition " + to_string(i + 1) + ": ", s, 1, INT_MAX,
+                     "Invalid size. Try again.") || !readTier(i, tier)) return;
+        bestFit.addPartition(defaultPool, s, tier);
+        recordAction("P " + to_string(s) + (tier != 0 ? " 1 " + to_string(tier) : ""));
     }
 
     int choice;       // User's menu choice
@@ -257,33 +1997,324 @@ int main() {
         cout << "2. Deallocate Job\n";
         cout << "3. Show Status\n";
         cout << "4. Exit\n";
-        cout << "Choose: ";
-        cin >> choice;
+        cout << "5. Set Backfill Mode\n";
+        cout << "6. Dump Latency Histograms\n";
+        cout << "7. Start/Stop Event Tracing\n";
+        cout << "8. Export Event Trace\n";
+        cout << "9. Show Partition Range\n";
+        cout << "10. Export Status (CSV / NDJSON)\n";
+        cout << "11. Add Memory Pool\n";
+        cout << "12. Set Routing Policy\n";
+        if (!readInt("Choose: ", choice, INT_MIN, INT_MAX, "Invalid choice. Try again.")) break; // End of input
+        if (choice != 2) bestFit.flushRetries(); // Only deallocations keep a coalescing window open
+        else bestFit.flushRetriesIfExpired();    // unless it timed out while the menu waited for input
 
         if (choice == 1) { // Add a new job
             Job j;
             j.jobNumber = jobCounter++; // Assign and increment job number
 
-            // Input validation for job size (must be > 0)
-            do {
-                cout << "Enter job size: ";
-                cin >> j.jobSize;
-                if (j.jobSize <= 0) cout << "Invalid size. Try again.\n";
-            } while (j.jobSize <= 0); // Loop until valid positive size is entered
+            // Input validation for job size (must be > 0) and priority (must be >= 0)
+            if (!readInt("Enter job size: ", j.jobSize, 1, INT_MAX, "Invalid size. Try again.")) break;
+            if (!readInt("Enter job priority (0 = normal, higher is served first): ", j.priority, 0, INT_MAX,
+                         "Invalid priority. Try again.")) break;
+            j.enqueueTick = 0;
+
+            // With several pools the job may name one; otherwise the router chooses
+            int pool = 0;
+            if (pools.size() > 1 &&
+                !readInt("Enter pool (0 = any, 1-" + to_string(pools.size()) + "): ", pool, 0,
+                         (int)pools.size(), "Invalid pool. Try again.")) break;
 
-            allocateJob(j); // Attempt allocation
+            recordAction("A " + to_string(j.jobSize) + " " + to_string(j.priority) + " " + to_string(pool));
+            allocateJob(j, pool - 1); // Attempt allocation
         }
         else if (choice == 2) { // Deallocate a job
             int jobNumber; // Renamed for consistency
-            cout << "Enter job number to deallocate: ";
-            cin >> jobNumber;
+            if (!readInt("Enter job number to deallocate: ", jobNumber, INT_MIN, INT_MAX,
+                         "Invalid job number. Try again.")) break;
+            recordAction("D " + to_string(jobNumber));
             deallocateJob(jobNumber); // Deallocate if found
         }
         else if (choice == 3) { // Show current status
+            recordAction("S");
             showStatus(); // Display table and metrics
         }
+        else if (choice == 5) { // Choose how blocked jobs are protected from starvation
+            int mode;
+            if (!readInt("Backfill mode (0 = Off, 1 = EASY, 2 = Conservative): ", mode, 0, 2,
+                         "Invalid mode. Try again.")) break;
+            recordAction("B " + to_string(mode));
+            bestFit.setBackfillMode((BackfillMode)mode);
+            cout << "\nBackfill mode set to " << backfillModeName(bestFit.backfillMode()) << ".\n";
+        }
+        else if (choice == 6) { // Full per-operation latency distributions
+            dumpLatencyHistograms();
+        }
+        else if (choice == 7) { // Toggle recording of allocator decisions
+            traceEnabled = !traceEnabled;
+            cout << "\nEvent tracing " << (traceEnabled ? "started" : "stopped") << ".\n";
+        }
+        else if (choice == 8) { // Write the recorded events as a Chrome trace
+            string path;
+            if (!readWord("Enter trace file name: ", path)) break;
+            if (exportTrace(path)) cout << "\nTrace written to " << path << ".\n";
+            else cout << "\nCould not write trace file " << path << ".\n";
+        }
+        else if (choice == 9) { // Page through a slice of a large partition table
+            int pool = 1, first, last, filter;
+            if ((pools.size() > 1 &&
+                 !readInt("Pool (1-" + to_string(pools.size()) + "): ", pool, 1, (int)pools.size(),
+                          "Invalid pool. Try again.")) ||
+                !readInt("First partition ID: ", first, INT_MIN, INT_MAX, "Invalid ID. Try again.") ||
+                !readInt("Last partition ID: ", last, INT_MIN, INT_MAX, "Invalid ID. Try again.") ||
+                !readInt("Show (0 = All, 1 = Used only, 2 = Free only): ", filter, 0, 2,
+                         "Invalid choice. Try again.")) break;
+            renderPartitionTable(pools[pool - 1], first - 1, last - 1, (RowFilter)filter); // IDs are index + 1
+        }
+        else if (choice == 10) { // Machine-readable dump for downstream analysis
+            int format;
+            string path;
+            if (!readInt("Format (1 = CSV, 2 = NDJSON): ", format, 1, 2, "Invalid format. Try again.") ||
+                !readWord(format == 1 ? "Enter file name prefix: " : "Enter file name: ", path)) break;
+            bool ok = (format == 1 ? exportStatusCsv(path) : exportStatusNdjson(path));
+            if (ok) cout << "\nStatus exported to " << path << (format == 1 ? "_*.csv" : "") << ".\n";
+            else cout << "\nCould not write " << path << ".\n";
+        }
+        else if (choice == 11) { // A separate memory region with its own partitions and queue
+            string name;
+            int count;
+            if (!readWord("Enter pool name: ", name)) break;
+            if (!validPoolName(name) || bestFit.findPool(name) != -1) {
+                cout << "\nPool names must be unique and use only letters, digits, '_' and '-'.\n";
+                continue;
+            }
+            if (!readInt("Enter number of partitions: ", count, 0, INT_MAX, "Invalid number. Try again.")) break;
+            int added = bestFit.addPool(name);
+            recordAction("N");
+            bool ended = false;
+            for (int i = 0; i < count && !ended; i++) {
+                int s, tier;
+                if (!readInt("Enter size of Partition " + to_string(i + 1) + ": ", s, 1, INT_MAX,
+                             "Invalid size. Try again.") || !readTier(i, tier)) ended = true;
+                else {
+                    bestFit.addPartition(added, s, tier);
+                    recordAction("P " + to_string(s) + " " + to_string(added + 1) + (tier != 0 ? " " + to_string(tier) : ""));
+                }
+            }
+            if (ended) break;
+            cout << "\nPool " << name << " added with " << count << " partition(s).\n";
+        }
+        else if (choice == 12) { // How jobs without a pool are spread over the pools
+            int policy;
+            if (!readInt("Routing policy (0 = Affinity, 1 = Least Utilized, 2 = Best Fit): ", policy, 0, 2,
+                         "Invalid policy. Try again.")) break;
+            recordAction("R " + to_string(policy));
+            bestFit.setRoutingPolicy((RoutingPolicy)policy);
+            cout << "\nRouting policy set to " << routingPolicyName(bestFit.routingPolicy()) << ".\n";
+        }
         // Choice 4 exits the loop
+
+        maybeWriteMetrics();
     } while (choice != 4);
+}
+
+// Main function: Sets up the simulation and runs the menu loop
+int main(int argc, char *argv[]) {
+    // Command line options:
+    //   --metrics-file PATH        periodically rewrite Prometheus metrics to PATH
+    //   --metrics-interval SECONDS minimum time between rewrites (default 5)
+    //   --trace PATH               record allocator events and write a Chrome trace to PATH on exit
+    //   --commands PATH            run the command protocol from PATH ("-" = stdin) instead of the menu
+    //   --convert-trace IN OUT     convert command file IN ("-" = stdin) to the binary trace OUT
+    //   --replay PATH              run a binary trace (made by --convert-trace) instead of the menu
+    //   --record PATH              record the menu session as a command file (see --commands)
+    //   --quiet                    do not print a message for every allocation and deallocation
+    //   --partitions LIST          partitions for --commands or --server, e.g. 512,1024,100x64
+    //                              (added to the first pool)
+    //   --pool NAME:LIST           add a pool named NAME with the partitions in LIST
+    //   --routing POLICY           affinity, least-utilized or best-fit (default) for jobs
+    //                              that do not name a pool
+    //   --placement MODE           best-fit (default), tiered or tiered-promote: prefer the
+    //                              fastest memory tier (partition lists take SIZE@TIER)
+    //   --tier-costs LIST          relative access cost of tiers 0, 1, ..., e.g. 1,1.8,4
+    //                              (default 1,2,4,...; only used for reporting)
+    //   --queue-limit N[:POLICY]   hold at most N waiting jobs per pool; beyond that reject
+    //                              (default), drop-oldest or spill (to a temporary file)
+    //   --coalesce COUNT[:MICROS]  retry the waiting queues once per COUNT deallocations
+    //                              (or once the first is MICROS old) instead of after each
+    //   --server PATH              serve the binary protocol on a Unix domain socket at PATH
+    //   --client PATH              generate load against a server at PATH, tuned by
+    //     --requests N (1000000) --pipeline DEPTH (32) --connections C (1) --max-job-size S (1000)
+    //   --simulate-clients N       run N coroutine clients against --partitions, each doing
+    //     --rounds R (10) allocate/hold/free cycles with jobs up to --max-job-size
+    string commandsPath, serverPath, clientPath, replayPath, convertFrom, convertTo, recordPath;
+    string resultOptions; // Options that change the results, for the header of a --record file
+    int simulatedClients = 0, simulatedRounds = 10;
+    long long clientRequests = 1000000;
+    int clientPipeline = 32, clientConnections = 1, clientMaxJobSize = 1000;
+    bestFit.addObserver(reportEvent); // Messages, trace and coroutine wake-ups
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+            metricsPath = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            metricsIntervalSeconds = max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+            traceEnabled = true;
+        } else if (strcmp(argv[i], "--commands") == 0 && i + 1 < argc) {
+            commandsPath = argv[++i];
+        } else if (strcmp(argv[i], "--convert-trace") == 0 && i + 2 < argc) {
+            convertFrom = argv[++i];
+            convertTo = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            quietMode = true;
+        } else if (strcmp(argv[i], "--partitions") == 0 && i + 1 < argc) {
+            if (pools.empty()) bestFit.addPool("default");
+            if (!addPartitionList(0, argv[++i])) {
+                cout << "Invalid partition list: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc) {
+            string spec = argv[++i];
+            size_t colon = spec.find(':');
+            string name = spec.substr(0, colon);
+            if (colon == string::npos || !validPoolName(name) || bestFit.findPool(name) != -1 ||
+                !addPartitionList(bestFit.addPool(name), spec.substr(colon + 1))) {
+                cout << "Invalid pool: " << spec << " (expected a new NAME:LIST)\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--routing") == 0 && i + 1 < argc) {
+            string policy = argv[++i];
+            resultOptions += string(" ") + argv[i - 1] + " " + argv[i];
+            if (policy == "affinity") bestFit.setRoutingPolicy(ROUTE_AFFINITY);
+            else if (policy == "least-utilized") bestFit.setRoutingPolicy(ROUTE_LEAST_UTILIZED);
+            else if (policy == "best-fit") bestFit.setRoutingPolicy(ROUTE_BEST_FIT);
+            else {
+                cout << "Unknown routing policy: " << policy << "\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--placement") == 0 && i + 1 < argc) {
+            string mode = argv[++i];
+            resultOptions += string(" ") + argv[i - 1] + " " + argv[i];
+            if (mode == "best-fit") bestFit.setPlacementMode(PLACE_BEST_FIT);
+            else if (mode == "tiered") bestFit.setPlacementMode(PLACE_TIERED);
+            else if (mode == "tiered-promote") bestFit.setPlacementMode(PLACE_TIERED_PROMOTE);
+            else {
+                cout << "Unknown placement mode: " << mode << "\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--tier-costs") == 0 && i + 1 < argc) {
+            string list = argv[++i];
+            resultOptions += string(" ") + argv[i - 1] + " " + argv[i];
+            size_t pos = 0;
+            for (int tier = 0; pos <= list.size(); tier++) {
+                size_t comma = list.find(',', pos);
+                double cost = atof(list.substr(pos, comma == string::npos ? string::npos : comma - pos).c_str());
+                if (tier >= MAX_TIERS || cost <= 0) {
+                    cout << "Invalid tier costs: " << list << " (expected up to " << MAX_TIERS << " positive numbers)\n";
+                    return 1;
+                }
+                bestFit.setTierCost(tier, cost);
+                if (comma == string::npos) break;
+                pos = comma + 1;
+            }
+        } else if (strcmp(argv[i], "--queue-limit") == 0 && i + 1 < argc) {
+            string spec = argv[++i];
+            resultOptions += string(" ") + argv[i - 1] + " " + argv[i];
+            size_t colon = spec.find(':');
+            int capacity = atoi(spec.substr(0, colon).c_str());
+            string policy = (colon == string::npos ? "reject" : spec.substr(colon + 1));
+            OverflowPolicy overflow = OVERFLOW_REJECT;
+            if (policy == "drop-oldest") overflow = OVERFLOW_DROP_OLDEST;
+            else if (policy == "spill") overflow = OVERFLOW_SPILL;
+            else if (policy != "reject") capacity = 0;
+            if (capacity < 1) {
+                cout << "Invalid queue limit: " << spec << " (expected N[:reject|drop-oldest|spill])\n";
+                return 1;
+            }
+            bestFit.setQueueLimit(capacity, overflow, &spillStore);
+        } else if (strcmp(argv[i], "--coalesce") == 0 && i + 1 < argc) {
+            string spec = argv[++i];
+            resultOptions += string(" ") + argv[i - 1] + " " + argv[i];
+            size_t colon = spec.find(':');
+            int count = atoi(spec.substr(0, colon).c_str());
+            long long micros = (colon == string::npos ? 0 : atoll(spec.substr(colon + 1).c_str()));
+            if (count < 1 || micros < 0) {
+                cout << "Invalid coalescing window: " << spec << " (expected COUNT[:MICROSECONDS])\n";
+                return 1;
+            }
+            bestFit.setCoalescing(count, micros * 1000);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            serverPath = argv[++i];
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            clientPath = argv[++i];
+        } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+            clientRequests = max(1LL, atoll(argv[++i]));
+        } else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            clientPipeline = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            clientConnections = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--max-job-size") == 0 && i + 1 < argc) {
+            clientMaxJobSize = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--simulate-clients") == 0 && i + 1 < argc) {
+            simulatedClients = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            simulatedRounds = max(1, atoi(argv[++i]));
+        } else {
+            cout << "Unknown option: " << argv[i] << "\n";
+            return 1;
+        }
+    }
+
+    // Nothing mixes C stdio with cout on the console, so drop the synchronisation
+    ios::sync_with_stdio(false);
+
+    if (!clientPath.empty()) {
+        runClient(clientPath, clientRequests, clientPipeline, clientConnections, clientMaxJobSize);
+        return 0;
+    }
+    if (!convertFrom.empty()) return convertCommandTrace(convertFrom, convertTo) ? 0 : 1;
+
+    // --commands, --replay, --server and the simulation start from the pools given on the command line
+    // (or an empty default pool); the menu asks for its partitions itself
+    bool poolsGiven = !pools.empty();
+    if (!poolsGiven && (!serverPath.empty() || simulatedClients > 0 || !commandsPath.empty() || !replayPath.empty()))
+        bestFit.addPool("default");
+
+    if (!serverPath.empty()) {
+        quietMode = true; // Nobody is watching the server's console per request
+        runServer(serverPath);
+    } else if (simulatedClients > 0) {
+        quietMode = true;
+        runCoroutineSimulation(simulatedClients, simulatedRounds, clientMaxJobSize);
+    } else if (!commandsPath.empty()) {
+        int fd = (commandsPath == "-" ? STDIN_FILENO : open(commandsPath.c_str(), O_RDONLY));
+        if (fd < 0) {
+            cout << "Could not open command file " << commandsPath << "\n";
+            return 1;
+        }
+        runCommands(fd);
+        if (fd != STDIN_FILENO) close(fd);
+    } else if (!replayPath.empty()) {
+        if (!replayTrace(replayPath)) return 1;
+    } else if (poolsGiven) {
+        cout << "--partitions and --pool are only used with --commands, --replay, --server or --simulate-clients\n";
+        return 1;
+    } else {
+        if (!recordPath.empty() && !startRecording(recordPath, resultOptions)) {
+            cout << "Could not write session file " << recordPath << "\n";
+            return 1;
+        }
+        runMenu();
+    }
+
+    if (!metricsPath.empty()) writeMetricsFile(); // Leave the final state for the scraper
+    if (!tracePath.empty() && !exportTrace(tracePath))
+        cout << "\nCould not write trace file " << tracePath << ".\n";
 
     return 0; // End program
 }